@@ -9,6 +9,12 @@ struct buf {
   struct buf *next;
   struct buf *qnext; // disk queue
   uchar data[BSIZE];
+  // Bulk request: when pages is set, nsect sectors starting at blockno
+  // are transferred to or from pages, PGSIZE / BSIZE sectors per page,
+  // instead of data. Bulk requests are not in the buffer cache.
+  char **pages;
+  uint nsect;
+  uint sect; // sectors done so far
 };
 #define B_VALID 0x2 // buffer has been read from disk
 #define B_DIRTY 0x4 // buffer needs to be written to disk
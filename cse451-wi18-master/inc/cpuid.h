@@ -148,3 +148,4 @@ enum {
 };
 
 void cpuid_print(void);
+int cpu_has_feature(unsigned int bit);
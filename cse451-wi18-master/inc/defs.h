@@ -3,14 +3,20 @@
 
 struct buf;
 struct context;
+struct cpu;
 struct extent;
 struct inode;
 struct proc;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
+struct spawn_action;
 struct stat;
 struct superblock;
+struct sys_info;
+struct timer;
+struct trap_frame;
+struct proc_info;
 struct vpage_info;
 struct vpi_page;
 struct vregion;
@@ -58,6 +64,7 @@ noreturn void panic(char *);
 
 // exec.c
 int exec(int n, char *, char **);
+int execload(struct vspace *, int, char *, char **, struct trap_frame *);
 
 // fs.c
 void readsb(int dev, struct superblock *sb);
@@ -81,6 +88,12 @@ void log_write(struct buf *);
 void log_commit_tx();
 void log_recover();
 
+// futex.c
+void futexinit(void);
+int futex_wait(uint64_t, int, uint);
+int futex_wake(uint64_t, int);
+void futexmoved(uint64_t);
+
 // ide.c
 void ideinit(void);
 void ideintr(void);
@@ -93,14 +106,15 @@ void ioapicinit(void);
 
 // kalloc.c
 struct core_map_entry *pa2page(uint64_t pa);
-struct swap_entry *getswapentry (uint64_t spn);
 void detect_memory(void);
 char *kalloc(void);
+char *kallochuge(void);
 void kfree(char *);
 void mem_init(void *);
 void mark_user_mem(uint64_t, uint64_t);
 void mark_kernel_mem(uint64_t);
-void swapin(uint64_t, uint64_t, uint64_t);
+int swapfault(struct vspace *, struct vregion *, uint64_t);
+void swapdinit(void);
 
 // kbd.c
 void kbdintr(void);
@@ -109,10 +123,14 @@ void kbdintr(void);
 void cmostime(struct rtcdate *r);
 int cpunum(void);
 extern volatile uint *lapic;
+void lapicarm(uint);
 void lapiceoi(void);
 void lapicinit(void);
+void lapicipi(struct cpu *, int);
+uint lapicms(void);
 void lapicstartap(uchar, uint);
 void microdelay(int);
+void tlbshootdown(void);
 
 // mp.c
 extern int ismp;
@@ -121,49 +139,106 @@ void mpinit(void);
 // vspace.c
 void                vspacebootinit(void);
 int                 vspaceinit(struct vspace *);
+struct vspace*      vspacealloc(void);
+struct vspace*      vspacedup(struct vspace *);
+void                vspacerelease(struct vspace *);
+int                 vspaceget(struct vspace *);
+void                vspaceput(struct vspace *);
+int                 vspacesresident(void);
 void                vspaceinitcode(struct vspace *, char *, uint64_t);
 int                 vspaceloadcode(struct vspace *, char *, uint64_t *);
 void                vspaceinvalidate(struct vspace *);
+void                vspaceupdate(struct vspace *, uint64_t);
+int                 vspacesplit(struct vspace *, uint64_t, char *);
+int                 vspacezerofault(struct vspace *, struct vregion *, uint64_t, int);
+int                 vspacefilefault(struct vspace *, struct vregion *, uint64_t);
 void                vspaceinstall(struct proc *);
 void                vspaceinstallkern(void);
 void                vregionfree(struct vspace *);
 void                vspacefree(struct vspace *);
 struct vregion*     va2vregion(struct vspace *, uint64_t);
 struct vpage_info*  va2vpage_info(struct vregion *, uint64_t);
+struct vpage_info*  va2vpage_info_alloc(struct vregion *, uint64_t);
 int                 vregioncontains(struct vregion *, uint64_t, int);
 int                 vspacecontains(struct vspace *, uint64_t, int);
-int                 vspacecopy(struct vspace *, struct vspace *);
 int                 vspaceshallowcopy(struct vspace *, struct vspace *);
 int                 vspaceinitstack(struct vspace *, uint64_t);
 int                 vspacewritetova(struct vspace *, uint64_t, char *, int);
 int                 vregionaddmap(struct vregion *, uint64_t, uint64_t, short, short);
-int                 vregiondelmap(struct vregion *, uint64_t, uint64_t);
 int                 vawasaccessed(struct vspace *, uint64_t);
+void                vspacesample(struct vspace *);
+struct vregion*     vregionnext(struct vspace *, struct vregion *);
+uint64_t            vspaceheaplimit(struct vspace *);
+int                 vspacemmap(struct vspace *, uint64_t, int, int, struct inode *, uint);
+void                vspacemsync(struct vspace *, uint64_t, uint64_t);
+int                 vspacemunmap(struct vspace *, uint64_t, uint64_t);
+int                 vspacemapshared(struct vspace *, char **, int);
+extern struct vspace kvspace;
+
+// pcache.c
+void pcacheinit(void);
+char *pcacheget(struct inode *, uint, int, int *);
+void pcachewrite(struct inode *, char *, uint, uint);
+int pcachereclaim(void);
+void pcachestat(struct sys_info *);
 
 // picirq.c
 void picenable(int);
 void picinit(void);
 
 // proc.c
+int clone(uint64_t, uint64_t, uint64_t);
 void exit(void);
 int fork(void);
 int growproc(int);
 int kill(int);
+int kthread_create(void (*)(void *), void *, char *);
 void pinit(void);
 void finit(void);
 void procdump(void);
+int procmeminfo(int, struct proc_info *);
+int setaffinity(int);
+int setpriority(int, int);
+int thread_join(int);
+void priorityreset(void);
+void schedtick(void);
+int wsshare(void);
 noreturn void scheduler(void);
 void sched(void);
 int sbrk(int); // added in LAB 3
+int spawn(char *, int, char **, struct spawn_action *, int);
 void sleep(void *, struct spinlock *);
 void userinit(void);
 int wait(void);
 void wakeup(void *);
 void yield(void);
 void reboot(void);
-uint64_t updatevpages(uint64_t, uint64_t, short, uint64_t, short); // added in LAB 4
 bool vaexists(uint64_t); // added in LAB 4
 
+// shm.c
+void shminit(void);
+int shmopen(char *, int);
+int shmat(int);
+int shmunlink(char *);
+
+// swap.c
+void swapinit(int);
+int swapon(struct inode *);
+int swapalloc(int *, uint64_t);
+void swapdup(uint64_t);
+void swapfree(uint64_t);
+int swapref(uint64_t);
+int swapadjacent(uint64_t);
+void swapio(uint64_t, char **, int, int);
+
+// zswap.c
+void zswapinit(void);
+int zswapstore(uint64_t, char *);
+int zswapload(uint64_t, char *);
+int zswapcontains(uint64_t);
+void zswapinvalidate(uint64_t);
+void zswapstat(struct sys_info *);
+
 // swtch.S
 void swtch(struct context **, struct context *);
 
@@ -178,6 +253,7 @@ void popcli(void);
 
 // sleeplock.c
 void acquiresleep(struct sleeplock *);
+int tryacquiresleep(struct sleeplock *);
 void releasesleep(struct sleeplock *);
 int holdingsleep(struct sleeplock *);
 void initsleeplock(struct sleeplock *, char *);
@@ -200,10 +276,20 @@ int argfd(int, int *); // LAB1
 int fetchint(uint64_t, int *);
 int fetchint64_t(uint64_t, int64_t *);
 int fetchstr(uint64_t, char **);
+void faultindone(void);
 void syscall(void);
 
+// timer.c
+extern uint msticks;
+void clockupdate(void);
+int msleep(uint);
+void timeradd(struct timer *, uint);
+void timerarm(uint);
+void timerdel(struct timer *);
+
 // trap.c
 void idtinit(void);
+int pagefault(struct vspace *, uint64_t, uint64_t);
 extern uint ticks;
 void tvinit(void);
 extern struct spinlock tickslock;
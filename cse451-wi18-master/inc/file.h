@@ -17,6 +17,7 @@ struct inode {
   uint inum; // Inode number
   int ref;   // Reference count
   struct sleeplock lock;
+  int swap;  // Backs a swap area, so writes to it fail
 
   short type; // copy of disk inode
   short devid;
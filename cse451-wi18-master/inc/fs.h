@@ -25,6 +25,7 @@ struct superblock {
   uint swapstart;  // Block number of the start of swap region
   // Added in LAB 5
   uint logstart;   // Block number of the start of the log region
+  uint nswap;      // Number of swap blocks
 
 };
 
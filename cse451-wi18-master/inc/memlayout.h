@@ -21,6 +21,7 @@
 #define AP_ENTRY 0x7000
 #define AP_OFFSET_CPUNUM 4 /* [0x7000-4, 0x7000) */
 #define AP_OFFSET_STACK 8  /* [0x7000-8, 0x7000-4) */
+#define AP_OFFSET_ENTRY 12 /* [0x7000-12, 0x7000-8) */
 
 #define EXTMEM 0x100000             // Start of extended memory
 #define DEVSPACE 0xFFFFFFFFFE000000 // Other devices are at high addresses
@@ -0,0 +1,12 @@
+#pragma once
+
+// mmap protections
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+
+// mmap flags: exactly one of MAP_SHARED and MAP_PRIVATE
+#define MAP_SHARED    0x01 // writes reach the file and other mappers
+#define MAP_PRIVATE   0x02 // writes make private copies
+#define MAP_ANONYMOUS 0x20 // zero-filled memory, no file
+
+#define MAP_FAILED ((void *)-1)
@@ -60,6 +60,11 @@
 
 #define PTE_NX BIT64(63) /* execute disable */
 
+// Page fault error code
+#define FEC_PR 0x1 /* caused by a protection violation */
+#define FEC_WR 0x2 /* caused by a write */
+#define FEC_U 0x4  /* occurred in user mode */
+
 #define PDPT_ADDR(pdpte) ((physaddr_t)(pdpte)&BITMASK64(51, 12))
 #define PDE_ADDR(pde) ((physaddr_t)(pde)&BITMASK64(51, 12))
 #define PTE_ADDR(pte) ((physaddr_t)(pte)&BITMASK64(51, 12))
@@ -77,6 +82,7 @@
 
 #define PDPT_SHIFT 30
 #define PTRS_PER_PDPT UINT64_C(512)
+#define PDPT_SIZE (UINT64_C(1) << PDPT_SHIFT)
 #define CAP_TYPE_X86_PDPT CAP_TYPE_PAGEMAP_L2
 
 #define PD_SHIFT 21
@@ -152,19 +158,15 @@ struct segdesc {
 
 #include <spinlock.h>
 
+struct vspace;
+
 struct core_map_entry {
   int available;
   short user;   // 0 if kernel allocated memory, otherwise is user
   uint64_t va;  // if it is used by kernel only, this field is 0
   int ref_count;// 1 if only one virtual address is associated with page
-  struct spinlock lock;
-};
-
-struct swap_entry {
-  int available;
-  short user;
-  uint64_t va;
-  int ref_count;
+  struct vspace *vs; // address space mapping a private user page, else 0
+  int pins;     // futex waiters keyed to it; not swapped out or reused
   struct spinlock lock;
 };
 
@@ -3,6 +3,10 @@
 #define KSTACKSIZE PGSIZE
 #define NPROC 64       // maximum number of processes
 #define NCPU 8         // maximum number of CPUs
+#define NPRIO 4        // scheduling priority levels
+#define BOOSTTICKS 100 // ticks between resets of every priority
+#define MSPERTICK 10   // milliseconds per tick
+#define MAXIDLEMS 1000 // longest an idle CPU halts without a timer due
 #define NOFILE 16      // open files per process
 #define NFILE 100      // open files per system
 #define NINODE 50      // maximum number of active i-nodes
@@ -16,3 +20,11 @@
 #define FSSIZE 100000             // size of file system in blocks
 #define MAXCODEPAGES 256
 #define MAXPATHLEN 20
+#define NSWAPSLOTS 2048 // pages in the swap region made by mkfs
+#define SWAPCLUSTER 8   // max pages moved by one swap request
+#define ZSWAPPAGES 16   // pages in the compressed swap pool
+#define NPCACHE 64      // pages in the file page cache
+#define NVMAP 64        // mmap regions per system
+#define NSHM 16         // shared memory segments per system
+#define SHMPAGES 64     // max pages in a shared memory segment
+#define TSTACKSIZE (16 * PGSIZE) // stack of each thread made by clone
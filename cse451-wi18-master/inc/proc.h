@@ -13,6 +13,13 @@ struct cpu {
   volatile uint started;     // Has the CPU started?
   int ncli;                  // Depth of pushcli nesting.
   int intena;                // Were interrupts enabled before pushcli?
+  volatile uint tlbflush;    // Set until a requested TLB flush is done
+  struct proc *runq[NPRIO];     // Runnable processes by level, oldest first
+  struct proc *runqtail[NPRIO]; // Last process in each runq
+  int nrunnable;                // Processes in all levels of runq
+  volatile int idle;            // Halted with nothing to run
+  volatile int resched;         // Current process should see if it must yield
+  uint runstart;                // When the current process was last charged
 
   struct cpu *cpu;
   struct proc *proc;
@@ -23,34 +30,24 @@ extern int ncpu;
 
 // Per-CPU variables, holding pointers to the
 // current cpu and to the current process.
-// The asm suffix tells gcc to use "%gs:0" to refer to cpu
-// and "%gs:4" to refer to proc.  seginit sets up the
-// %gs segment register so that %gs refers to the memory
-// holding those two variables in the local cpu's struct cpu.
+// "%gs:0" refers to cpu and "%gs:8" to proc.  seginit sets up
+// the %gs base so that %gs refers to the memory holding those
+// two variables in the local cpu's struct cpu.
 // This is similar to how thread-local variables are implemented
 // in thread libraries such as Linux pthreads.
+// Each is read with a single instruction, so the result is right
+// even if the process moves to another CPU right after.
 
-// static inline struct cpu *
-static struct cpu *mycpu(void) {
-  // uint64_t val;
-  // __asm volatile("movq %%gs:0, %0" : "=r" (val));
-  // if (val != 0xffffffff8019a780) {
-  //   while (1) {}
-  // }
-  // return (struct cpu *)val;
-
-  // struct cpu* c = &cpus[cpunum()];
-  // return c;
-
-  // single-core for now
-  return &cpus[0];
+static inline struct cpu *mycpu(void) {
+  struct cpu *c;
+  asm volatile("movq %%gs:0, %0" : "=r"(c));
+  return c;
 }
 
 static inline struct proc *myproc(void) {
-  // uint64_t val;
-  // __asm volatile("movq %%gs:8, %0" : "=r" (val));
-  // return (struct proc *)val;
-  return mycpu()->proc;
+  struct proc *p;
+  asm volatile("movq %%gs:8, %0" : "=r"(p));
+  return p;
 }
 
 // Saved registers for kernel context switches.
@@ -76,9 +73,15 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// Open files of a process, indexed by fd. Threads share one.
+struct fdtable {
+  int ref;                     // Processes using it; 0 if free
+  struct file *fd[NOFILE];
+};
+
 // Per-process state
 struct proc {
-  struct vspace vspace;        // Virtual address space descriptor
+  struct vspace *vspace;       // Virtual address space, shared by threads
   char* kstack;                // Kernel stack
   enum procstate state;        // Process state
   int pid;                     // Process ID
@@ -88,7 +91,18 @@ struct proc {
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   char name[16];               // Process name (debugging)
-  struct file *file_table[NOFILE];
+  struct fdtable *fdtable;     // Open files, shared by threads
+  uint64_t ustack;             // Bottom of a thread's stack mapping, or 0
+  struct vspace *pinned;       // Vspace the current syscall faulted in
+  struct proc *rqnext;         // Next process in the run queue
+  struct proc *waitnext;       // Next process in the wait queue
+  struct proc **waitprev;      // Link pointing to it in the wait queue
+  struct cpu *cpu;             // CPU whose run queue holds it, or last ran it
+  int affinity;                // Preferred CPU, or -1
+  int prio;                    // Scheduling level, 0 runs first
+  uint slice;                  // Milliseconds used of the quantum at prio
+  void (*kfn)(void *);         // Kernel thread function, or 0 for a process
+  void *karg;                  // Argument to kfn
 };
 
 // Process memory is laid out contiguously, low addresses first:
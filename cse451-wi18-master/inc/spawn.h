@@ -0,0 +1,12 @@
+#pragma once
+
+// spawn file actions, applied in order to the child's copy of the
+// caller's open files
+#define SPAWN_CLOSE 1 // close fd
+#define SPAWN_DUP2  2 // make newfd refer to the file of fd, closing it first
+
+struct spawn_action {
+  int op;
+  int fd;
+  int newfd;
+};
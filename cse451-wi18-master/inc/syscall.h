@@ -22,3 +22,19 @@
 #define SYS_close 21
 #define SYS_sysinfo 22
 #define SYS_crashn 23
+#define SYS_swapon 24
+#define SYS_procinfo 25
+#define SYS_mmap 26
+#define SYS_munmap 27
+#define SYS_msync 28
+#define SYS_shmopen 29
+#define SYS_shmat 30
+#define SYS_shmunlink 31
+#define SYS_setaffinity 32
+#define SYS_setpriority 33
+#define SYS_nanosleep 34
+#define SYS_clone 35
+#define SYS_thread_join 36
+#define SYS_futex_wait 37
+#define SYS_futex_wake 38
+#define SYS_spawn 39
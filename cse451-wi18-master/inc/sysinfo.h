@@ -6,4 +6,25 @@ struct sys_info {
   int free_pages;
   int num_page_faults;
   int num_disk_reads;
+  int zswap_pages;      // pages held compressed in memory
+  int zswap_bytes;      // their compressed size
+  int zswap_hits;       // swap reads served without I/O
+  int zswap_misses;     // swap reads that went to disk
+  int zswap_writebacks; // compressed pages written back to disk
+  int zswap_rejects;    // pages that did not compress well enough
+  int pcache_pages;     // file pages cached for sharing
+  int pcache_hits;      // file page faults served from the cache
+  int pcache_misses;    // file page faults that read the file
+};
+
+// Memory use of one process.
+struct proc_info {
+  int rss;          // resident pages
+  int swapped;      // pages out in swap
+  int wss;          // pages referenced in the last sampling interval
+  int major_faults; // faults that read from disk
+  int minor_faults; // faults served without I/O
+  int cow_breaks;   // copy-on-write breaks
+  int huge_pages;   // 2 MiB pages mapped
+  int priority;     // scheduling level, 0 highest
 };
@@ -0,0 +1,8 @@
+#pragma once
+
+// A timer in the timing wheel. Processes sleep on it until it fires.
+struct timer {
+  uint expires;        // millisecond at which it fires
+  struct timer *next;  // next timer in the wheel slot
+  struct timer **prev; // link pointing to it, or 0 if not armed
+};
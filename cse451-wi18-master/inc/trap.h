@@ -28,6 +28,8 @@
 
 #define TRAP_IRQ0 32
 #define TRAP_SYSCALL 64 // system call
+#define TRAP_TLBFLUSH 65 // TLB shootdown IPI
+#define TRAP_RESCHED 66  // look at the run queue IPI
 
 #define IRQ_TIMER 0
 #define IRQ_KBD 1
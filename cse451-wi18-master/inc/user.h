@@ -3,6 +3,18 @@
 struct stat;
 struct rtcdate;
 struct sys_info;
+struct proc_info;
+struct spawn_action;
+
+// A lock for threads: 0 if free, 1 if held, 2 if held with waiters.
+struct mutex {
+  volatile int state;
+};
+
+// A condition variable: bumped on each signal.
+struct cond {
+  volatile int seq;
+};
 
 // system calls
 int fork(void);
@@ -28,6 +40,22 @@ int sleep(int);
 int uptime(void);
 int sysinfo(struct sys_info *);
 int crashn(int);
+int swapon(char *);
+int procinfo(int, struct proc_info *);
+void *mmap(void *, int, int, int, int, int);
+int munmap(void *, int);
+int msync(void *, int);
+int shmopen(char *, int);
+void *shmat(int);
+int shmunlink(char *);
+int setaffinity(int);
+int setpriority(int, int);
+int nanosleep(int64_t);
+int clone(void (*)(void *, void *), void *, void *);
+int thread_join(int);
+int futex_wait(volatile int *, int, int);
+int futex_wake(volatile int *, int);
+int spawn(char *, char **, struct spawn_action *, int);
 
 // ulib.c
 int stat(char *, struct stat *);
@@ -42,3 +70,11 @@ void *memset(void *, int, uint);
 void *malloc(uint);
 void free(void *);
 int atoi(const char *);
+int thread_create(void (*)(void *), void *);
+void mutex_init(struct mutex *);
+void mutex_lock(struct mutex *);
+void mutex_unlock(struct mutex *);
+void cond_init(struct cond *);
+void cond_wait(struct cond *, struct mutex *);
+void cond_signal(struct cond *);
+void cond_broadcast(struct cond *);
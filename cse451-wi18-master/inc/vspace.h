@@ -2,6 +2,7 @@
 
 #include <defs.h>
 #include <mmu.h>
+#include <sleeplock.h>
 
 #define NREGIONS 3
 
@@ -15,27 +16,44 @@ enum {
 #define VPI_WRITABLE ((short) 1)
 #define VPI_COW      ((short) 1)
 #define VPI_SWAP     ((short) 1)
+#define VPI_FILE     ((short) 1)
 
 struct vpage_info {
   short used;
+  short huge;   // part of a huge page: PTRS_PER_PT contiguous frames
+                // mapped by one PDE, starting at a PD_SIZE boundary
+  short file;   // not yet read from the region's file
   uint64_t ppn;
   short present;
   short writable;
   // user defined fields
   short cow;
   short swap;
-  uint64_t spn; // swap page number
+  union {
+    uint64_t spn;   // swap page number
+    struct {
+      uint fileoff; // where the page's data starts in the file
+      uint filelen; // bytes of data; the rest of the page is zero
+    };
+  };
 };
 
-#define VPIPPAGE ((PGSIZE/sizeof(struct vpage_info)) - 1)
+#define VPIPPAGE (PGSIZE/sizeof(struct vpage_info))
+#define VPIFANOUT (PGSIZE/sizeof(void *))
 #define VRTOP(r) \
   ((r)->dir == VRDIR_UP ? (r)->va_base + (r)->size : (r)->va_base)
 #define VRBOT(r) \
   ((r)->dir == VRDIR_UP ? (r)->va_base : (r)->va_base - (r)->size)
 
+// The page infos of a region are kept in a radix tree indexed by the
+// page's distance from the region's base. Leaves are vpi_pages; a tree
+// of height h has h levels of vpi_nodes above them.
 struct vpi_page {
   struct vpage_info infos[VPIPPAGE];
-  struct vpi_page *next;
+};
+
+struct vpi_node {
+  void *slots[VPIFANOUT];
 };
 
 enum vr_direction {
@@ -47,11 +65,44 @@ struct vregion {
   enum vr_direction dir;  // direction of growth
   uint64_t va_base;       // base of the region
   uint64_t size;          // size of region in bytes
-  struct vpi_page *pages;  // pointer to array of page_infos
+  void *pages;            // root of the page info radix tree
+  int height;             // levels of vpi_nodes above the leaves
+  struct inode *ip;       // file its file pages are read from, or 0
+  uint off;               // file offset of va_base, for a mapped file
+  short shared;           // MAP_SHARED: pages are never copied
+  short readonly;         // no write access
+  struct vregion *next;   // next mapping, lower in memory
+};
+
+// Iterates over the fixed regions of vs, then its mappings.
+#define for_each_vregion(vr, vs) \
+  for ((vr) = (vs)->regions; (vr); (vr) = vregionnext((vs), (vr)))
+
+// Memory accounting for an address space.
+struct vmstat {
+  int rss;       // resident pages
+  int swapped;   // pages out in swap
+  int wss;       // pages referenced during the last sampling interval
+  uint wsstamp;  // ticks when the working set was last sampled
+  int majflt;    // faults that read from disk
+  int minflt;    // faults served without I/O
+  int cowbreaks; // copy-on-write breaks
+  int huge;      // huge pages mapped
 };
 
+// Ticks between working-set samples.
+#define WSINTERVAL 100
+
 struct vspace {
   struct vregion regions[NREGIONS];
+  struct vregion *maps;   // regions made by mmap, highest first
   pml4e_t* pgtbl;
+  struct vmstat stat;
+  int ref;                // threads sharing it; 0 if free, -1 if freeing
+  int swaprefs;           // references the swapper holds
+  int kpins;              // syscalls that faulted pages in; not swapped
+  // Held while the mappings change, so that the threads sharing the
+  // vspace fault and map one at a time.
+  struct sleeplock lock;
 };
 
@@ -108,10 +108,20 @@ static inline uint64_t rcr2(void) {
   return val;
 }
 
+static inline uint64_t rcr3(void) {
+  uint64_t val;
+  asm volatile("mov %%cr3,%0" : "=r"(val));
+  return val;
+}
+
 static inline void lcr3(uint64_t val) {
   asm volatile("mov %0,%%cr3" : : "r"(val));
 }
 
+static inline void invlpg(void *va) {
+  asm volatile("invlpg (%0)" : : "r"(va) : "memory");
+}
+
 static inline uint64_t rdmsr(uint32_t msr) {
   uint32_t lo, hi;
 
@@ -119,6 +129,13 @@ static inline uint64_t rdmsr(uint32_t msr) {
   return lo | ((uint64_t)hi << 32);
 }
 
+static inline uint64_t rdtsc(void) {
+  uint32_t lo, hi;
+
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return lo | ((uint64_t)hi << 32);
+}
+
 static inline void wrmsr(uint32_t msr, uint64_t val) {
   uint32_t lo = val & 0xffffffff, hi = val >> 32;
 
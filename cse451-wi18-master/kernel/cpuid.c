@@ -126,6 +126,20 @@ static bool cpuid_has(uint32_t *feature, unsigned int bit) {
   return feature[bit / 32] & BIT32(bit % 32);
 }
 
+static void cpuid_features(uint32_t *feature) {
+  cpuid(1, NULL, NULL, &feature[CPUID_1_ECX], &feature[CPUID_1_EDX]);
+  cpuid(0x80000001, NULL, NULL, &feature[CPUID_80000001_ECX],
+        &feature[CPUID_80000001_EDX]);
+}
+
+// Tests whether the CPU has feature bit, one of CPUID_FEATURE_*.
+int cpu_has_feature(unsigned int bit) {
+  uint32_t feature[CPUID_NR_FLAGS] = {0};
+
+  cpuid_features(feature);
+  return cpuid_has(feature, bit);
+}
+
 void cpuid_print(void) {
   uint32_t eax, brand[12], feature[CPUID_NR_FLAGS] = {0};
 
@@ -138,9 +152,7 @@ void cpuid_print(void) {
   cpuid(0x80000004, &brand[8], &brand[9], &brand[10], &brand[11]);
   cprintf("CPU: %s\n", brand);
 
-  cpuid(1, NULL, NULL, &feature[CPUID_1_ECX], &feature[CPUID_1_EDX]);
-  cpuid(0x80000001, NULL, NULL, &feature[CPUID_80000001_ECX],
-        &feature[CPUID_80000001_EDX]);
+  cpuid_features(feature);
   print_feature(feature);
   // Check feature bits.
   assert(cpuid_has(feature, CPUID_FEATURE_PSE));
@@ -9,23 +9,21 @@
 #include <x86_64.h>
 #include <x86_64vm.h>
 
-int exec(int n, char *path, char **argv) {
-
-  struct vspace temp;
-  vspaceinit(&temp);
-
+// Loads the program at path into vs, a fresh vspace, with the n
+// arguments argv on its stack, and sets up tf to start it. argv may
+// live in the current address space. Returns 0, or -1.
+int execload(struct vspace *vs, int n, char *path, char **argv,
+             struct trap_frame *tf) {
   uint64_t rip;
-  int size = vspaceloadcode(&temp, path, &rip);
+  int size = vspaceloadcode(vs, path, &rip);
   if (size == 0) {
-    vspacefree(&temp);
     return -1;
   }
 
   int res;
 
-  res = vspaceinitstack(&temp, SZ_2G);
+  res = vspaceinitstack(vs, SZ_2G);
   if (res < 0) {
-    vspacefree(&temp);
     return -1;
   }
 
@@ -47,9 +45,8 @@ int exec(int n, char *path, char **argv) {
     uint64_t size = strlen(argv[i]) + 1 + 8; // 8 to ceil
     va -= (size / 8) * 8;
     // write data into the current address, return -1 if it fails
-    res = vspacewritetova(&temp, va, argv[i], strlen(argv[i]) + 1);
+    res = vspacewritetova(vs, va, argv[i], strlen(argv[i]) + 1);
     if (res < 0) {
-      vspacefree(&temp);
       return -1;
     }
     // add argument address to user stack
@@ -61,31 +58,44 @@ int exec(int n, char *path, char **argv) {
 
   // write the pointers to the string arguments in the user stack to the
   // user stack, along with a null terminator and a garbage return pc
-  if (vspacewritetova(&temp, va, (char*)ustack_args, (2 + n) * 8) < 0) {
-    vspacefree(&temp);
+  if (vspacewritetova(vs, va, (char*)ustack_args, (2 + n) * 8) < 0) {
     return -1;
   }
 
   // set up the registers
-  myproc()->tf->rip = rip;
-  myproc()->tf->rsi = va + 8;
-  myproc()->tf->rdi = n;
-  myproc()->tf->rsp = va;
+  tf->rip = rip;
+  tf->rsi = va + 8;
+  tf->rdi = n;
+  tf->rsp = va;
 
-  // free vregion, but save a ptr to the pgtbl
-  pml4e_t *pgtbl = myproc()->vspace.pgtbl;
-  vregionfree(&(myproc()->vspace));
-  vspaceinit(&myproc()->vspace); 
-  vspaceinstall(myproc());
+  return 0;
+}
 
-  // copy temp into the current vspace
-  res = vspacecopy(&(myproc()->vspace), &temp);
-  
-  // now free the pgtbl and the temp
-  vspacefree(&temp);
-  freevm(pgtbl);
-  if (res < 0)
+int exec(int n, char *path, char **argv) {
+  struct vspace *temp, *old;
+  int r;
+
+  // Other threads would be left running the old program.
+  if (myproc()->vspace->ref > 1)
+    return -1;
+  if ((temp = vspacealloc()) == 0)
+    return -1;
+  // Its lock keeps the swapper off the pages while they are loaded.
+  acquiresleep(&temp->lock);
+  r = execload(temp, n, path, argv, myproc()->tf);
+  releasesleep(&temp->lock);
+  if (r < 0) {
+    vspacerelease(temp);
     return -1;
+  }
+
+  // temp becomes the current vspace, and the old one is written back
+  // and freed
+  faultindone();
+  old = myproc()->vspace;
+  myproc()->vspace = temp;
+  vspaceinstall(myproc());
+  vspacerelease(old);
 
   return 0;
 }
@@ -59,7 +59,7 @@ int fileclose(struct proc *p, struct file *f, int fd) {
   }
 
   // remove the file from the current process's file table
-  p->file_table[fd] = NULL;
+  p->fdtable->fd[fd] = NULL;
   return 0;
 }
 
@@ -92,9 +92,13 @@ int filewrite(struct file *f, char *buf, int bytes_written) {
     struct sleeplock *lock = &(f->inode->lock);
     acquiresleep(lock);
 
+    // Programs already running keep the pages they have, and shared
+    // mappings see the new data (see pcachewrite). msync writes with
+    // writei directly, as the cached pages are what it writes.
     res = writei(f->inode, buf, f->offset, bytes_written);
 
     if (res >= 0) {
+      pcachewrite(f->inode, buf, f->offset, res);
       f->offset += res;
       f->inode->size += res;
       updatei(f->inode);
@@ -116,8 +120,8 @@ int filewrite(struct file *f, char *buf, int bytes_written) {
 
 int filedup(struct proc *p, struct file *f) {
   for (int i = 0; i < NOFILE; i++) {
-    if (p->file_table[i] == NULL) {
-      p->file_table[i] = &(ftable.file_table[f->global_fd]);
+    if (p->fdtable->fd[i] == NULL) {
+      p->fdtable->fd[i] = &(ftable.file_table[f->global_fd]);
       ftable.file_table[f->global_fd].ref_count++;
       return i;
     }
@@ -141,8 +145,8 @@ int fileopen(struct proc *p, struct inode *ptr, int mode) {
 
       // Add to process file table
       for (int j = 0; j < NOFILE; j++) {
-        if (p->file_table[j] == NULL) {
-          p->file_table[j] = &(ftable.file_table[i]);
+        if (p->fdtable->fd[j] == NULL) {
+          p->fdtable->fd[j] = &(ftable.file_table[i]);
           return j;
         }
       }	
@@ -160,7 +164,7 @@ int checkProcFileTable(int *fds) {
   struct proc *p = myproc();
   int index = 0;
   for (int i = 0; i < NOFILE; i++) {
-    if (p->file_table[i] == NULL) {
+    if (p->fdtable->fd[i] == NULL) {
       fds[index] = i;
       index++;
     }
@@ -220,8 +224,8 @@ int pipe(int *fds) {
 
   // add to proc file table
   struct proc *p = myproc();
-  p->file_table[proc_fd[0]] = &(ftable.file_table[fd[0]]);
-  p->file_table[proc_fd[1]] = &(ftable.file_table[fd[1]]);
+  p->fdtable->fd[proc_fd[0]] = &(ftable.file_table[fd[0]]);
+  p->fdtable->fd[proc_fd[1]] = &(ftable.file_table[fd[1]]);
 
   // initialize the lock for this new pipe
   initlock(&(pipe_ptr->lock), "pipe");
@@ -179,6 +179,7 @@ static struct inode *iget(uint dev, uint inum) {
   ip->ref = 1;
   ip->dev = dev;
   ip->inum = inum;
+  ip->swap = 0;
 
   release(&icache.lock);
 
@@ -424,6 +425,9 @@ int writei(struct inode *ip, char *src, uint off, uint n) {
       return -1;
     return devsw[ip->devid].write(ip, src, n);
   }
+  // Swap owns the blocks of a swap file.
+  if (ip->swap)
+    return -1;
 
   uint append = 0; 
   uint capacity = getCapacity(ip);
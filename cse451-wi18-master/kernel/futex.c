@@ -0,0 +1,240 @@
+// Futexes.
+//
+// A futex is a word of user memory that user-space locks and condition
+// variables block on when they are contended. futex_wait sleeps as
+// long as the word holds the value the caller last saw, and futex_wake
+// wakes sleepers after the word changes; the uncontended paths never
+// enter the kernel (see the mutex and condvar in ulib.c).
+//
+// Waiters are keyed by the physical address of the word, so a word in
+// memory shared between processes works as well as one shared between
+// threads. A waiter pins the page, which keeps it from being swapped
+// out and its frame from being reused while it sleeps. A copy-on-write
+// break may still move the word to a new frame; the waiters on the old
+// one are woken then, and look at their words again.
+// Waiters hang off a hashed table of queues, each with its own lock,
+// so a wakeup looks only at the waiters of words that hash alike.
+//
+// A waiter sleeps on its timer, like msleep. Both a timeout and a
+// futex_wake wake it under tickslock, so neither wakeup is lost.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <timer.h>
+#include <vspace.h>
+
+#define FUTEXBITS 6
+#define NFUTEXQ (1 << FUTEXBITS) // wait queue buckets
+
+struct futexw {
+  uint64_t key;        // physical address of the word
+  int woken;           // set by futex_wake, under tickslock
+  struct timer t;      // timeout, if armed; sleeps on it
+  struct futexw *next; // next waiter in the queue
+};
+
+struct futexq {
+  struct spinlock lock;
+  struct futexw *head; // oldest first
+};
+
+static struct futexq futexqs[NFUTEXQ];
+
+void
+futexinit(void)
+{
+  int i;
+
+  for (i = 0; i < NFUTEXQ; i++)
+    initlock(&futexqs[i].lock, "futex");
+}
+
+// Returns the queue for key.
+static struct futexq *
+futexq(uint64_t key)
+{
+  // Fibonacci hashing, as for the process wait queues.
+  return &futexqs[(key * 0x9E3779B97F4A7C15ull) >> (64 - FUTEXBITS)];
+}
+
+// Returns the physical address of the word at va in vs, or 0 if there
+// is none. To wait, the page is faulted in writable first, as its
+// owner would write it, and pinned. To wake, a page that is not
+// resident has no waiters. Caller must hold the vspace's lock.
+static uint64_t
+futexkey(struct vspace *vs, uint64_t va, int wait)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  struct core_map_entry *cme;
+  uint64_t pa;
+
+  if (va % sizeof(int))
+    return 0;
+
+  if (!(vr = va2vregion(vs, va)) || vr->readonly)
+    return 0;
+  vpi = va2vpage_info(vr, va);
+  if (wait && !(vpi && vpi->used && vpi->present && vpi->writable)) {
+    // Swap it in, fill it or break copy-on-write, as a write would.
+    pagefault(vs, va, FEC_WR);
+    vpi = va2vpage_info(vr, va);
+  }
+  if (!vpi || !vpi->used || !vpi->present || (wait && !vpi->writable))
+    return 0;
+  pa = (vpi->ppn << PT_SHIFT) + va % PGSIZE;
+  if (wait) {
+    cme = pa2page(pa);
+    acquire(&cme->lock);
+    cme->pins++;
+    release(&cme->lock);
+  }
+  return pa;
+}
+
+// Drops futexkey's pin on the page at pa, freeing it if the process
+// unmapped it meanwhile.
+static void
+unpin(uint64_t pa)
+{
+  struct core_map_entry *cme = pa2page(pa);
+  int gone;
+
+  acquire(&cme->lock);
+  gone = --cme->pins == 0 && cme->ref_count == 0;
+  release(&cme->lock);
+  if (gone)
+    kfree(P2V(PGROUNDDOWN(pa)));
+}
+
+// Wakes up to n waiters of q whose keys match key in the bits of mask,
+// oldest first. Returns how many it woke. Caller must hold q->lock.
+static int
+wakeq(struct futexq *q, uint64_t key, uint64_t mask, int n)
+{
+  struct futexw *w, **pp;
+  int woken = 0;
+
+  acquire(&tickslock);
+  for (pp = &q->head; (w = *pp) && woken < n;) {
+    if ((w->key & mask) != key) {
+      pp = &w->next;
+      continue;
+    }
+    *pp = w->next;
+    w->woken = 1;
+    wakeup(&w->t);
+    woken++;
+  }
+  release(&tickslock);
+  return woken;
+}
+
+// Sleeps until a futex_wake of the word at va, if the word holds val,
+// for at most timeout milliseconds unless timeout is 0. Returns 0 when
+// woken, and -1 if the word did not hold val, on timeout, if killed,
+// or if va is not a word of a writable mapping.
+int
+futex_wait(uint64_t va, int val, uint timeout)
+{
+  struct vspace *vs = myproc()->vspace;
+  struct futexq *q;
+  struct futexw w, **pp;
+  uint64_t pa;
+
+  acquiresleep(&vs->lock);
+  if (!(pa = futexkey(vs, va, 1))) {
+    releasesleep(&vs->lock);
+    return -1;
+  }
+
+  q = futexq(pa);
+  w.key = pa;
+  w.woken = 0;
+  w.next = 0;
+  w.t.prev = 0;
+
+  acquire(&q->lock);
+  // A futex_wake after the word changed takes q->lock, so it either
+  // comes before this test or finds w queued. The vspace lock keeps
+  // the word at pa until then.
+  if (*(volatile int *)P2V(pa) != val) {
+    release(&q->lock);
+    releasesleep(&vs->lock);
+    unpin(pa);
+    return -1;
+  }
+  for (pp = &q->head; *pp; pp = &(*pp)->next)
+    ;
+  *pp = &w;
+  releasesleep(&vs->lock);
+
+  acquire(&tickslock);
+  release(&q->lock);
+  if (timeout) {
+    clockupdate();
+    timeradd(&w.t, msticks + timeout);
+  }
+  while (!w.woken && (!timeout || w.t.prev) && !myproc()->killed)
+    sleep(&w.t, &tickslock);
+  if (w.t.prev)
+    timerdel(&w.t);
+  release(&tickslock);
+
+  // Leave the queue, unless a wakeup took w off it meanwhile.
+  acquire(&q->lock);
+  if (!w.woken) {
+    for (pp = &q->head; *pp != &w; pp = &(*pp)->next)
+      ;
+    *pp = w.next;
+  }
+  release(&q->lock);
+
+  unpin(pa);
+  return w.woken ? 0 : -1;
+}
+
+// Wakes up to n of the processes waiting on the word at va, oldest
+// first. Returns how many it woke.
+int
+futex_wake(uint64_t va, int n)
+{
+  struct vspace *vs = myproc()->vspace;
+  struct futexq *q;
+  uint64_t pa;
+  int woken;
+
+  if (n <= 0)
+    return 0;
+  acquiresleep(&vs->lock);
+  pa = futexkey(vs, va, 0);
+  releasesleep(&vs->lock);
+  if (!pa)
+    return 0;
+
+  q = futexq(pa);
+  acquire(&q->lock);
+  woken = wakeq(q, pa, ~0ull, n);
+  release(&q->lock);
+  return woken;
+}
+
+// Wakes every waiter on a word of the page at pa, from which a
+// copy-on-write break has moved a process, so that their keys may be
+// stale. They return as if woken by futex_wake.
+void
+futexmoved(uint64_t pa)
+{
+  struct futexq *q;
+
+  for (q = futexqs; q < &futexqs[NFUTEXQ]; q++) {
+    acquire(&q->lock);
+    wakeq(q, PGROUNDDOWN(pa), ~(uint64_t)(PGSIZE - 1), NPROC);
+    release(&q->lock);
+  }
+}
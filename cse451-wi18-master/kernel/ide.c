@@ -35,6 +35,11 @@ static struct buf *idequeue;
 static int havedisk1;
 static void idestart(struct buf *);
 
+// Sector i of a bulk request.
+static void *bulksect(struct buf *b, uint i) {
+  return b->pages[i / (PGSIZE / SECTOR_SIZE)] + (i % (PGSIZE / SECTOR_SIZE)) * SECTOR_SIZE;
+}
+
 // Wait for IDE disk to become ready.
 static int idewait(int checkerr) {
   int r;
@@ -71,7 +76,7 @@ void ideinit(void) {
 static void idestart(struct buf *b) {
   if (b == 0)
     panic("idestart");
-  if (b->blockno >= FSSIZE)
+  if (b->blockno >= FSSIZE || (b->pages && b->blockno + b->nsect > FSSIZE))
     panic("incorrect blockno");
   int sector_per_block = BSIZE / SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
@@ -81,6 +86,17 @@ static void idestart(struct buf *b) {
   if (sector_per_block > 7)
     panic("idestart");
 
+  // A bulk request moves every sector with one command, one sector
+  // per interrupt.
+  if (b->pages) {
+    if (b->nsect == 0 || b->nsect > 255)
+      panic("idestart: bulk size");
+    b->sect = 0;
+    sector_per_block = b->nsect;
+    read_cmd = IDE_CMD_READ;
+    write_cmd = IDE_CMD_WRITE;
+  }
+
   idewait(0);
   outb(0x3f6, 0);                // generate interrupt
   outb(0x1f2, sector_per_block); // number of sectors
@@ -90,7 +106,11 @@ static void idestart(struct buf *b) {
   outb(0x1f6, 0xe0 | ((b->dev & 1) << 4) | ((sector >> 24) & 0x0f));
   if (b->flags & B_DIRTY) {
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE / 4);
+    if (b->pages) {
+      idewait(0);
+      outsl(0x1f0, bulksect(b, 0), SECTOR_SIZE / 4);
+    } else
+      outsl(0x1f0, b->data, BSIZE / 4);
   } else {
     outb(0x1f7, read_cmd);
   }
@@ -107,10 +127,24 @@ void ideintr(void) {
     // cprintf("spurious IDE interrupt\n");
     return;
   }
+
+  // A bulk request stays active until its last sector is done.
+  if (b->pages) {
+    if (!(b->flags & B_DIRTY) && idewait(1) >= 0)
+      insl(0x1f0, bulksect(b, b->sect), SECTOR_SIZE / 4);
+    if (++b->sect < b->nsect) {
+      if (b->flags & B_DIRTY) {
+        idewait(0);
+        outsl(0x1f0, bulksect(b, b->sect), SECTOR_SIZE / 4);
+      }
+      release(&idelock);
+      return;
+    }
+  }
   idequeue = b->qnext;
 
   // Read data if needed.
-  if (!(b->flags & B_DIRTY) && idewait(1) >= 0)
+  if (!b->pages && !(b->flags & B_DIRTY) && idewait(1) >= 0)
     insl(0x1f0, b->data, BSIZE / 4);
 
   // Wake process waiting for this buf.
@@ -13,6 +13,9 @@
 #include <fs.h>
 #include <sleeplock.h>
 #include <buf.h>
+#include <vspace.h>
+#include <x86_64.h>
+#include <x86_64vm.h>
 
 int npages = 0;
 // LAB 4
@@ -23,10 +26,14 @@ int pages_in_swap;
 int free_pages;
 
 struct core_map_entry *core_map = NULL;
-// LAB 4
-struct swap_entry swap_map[2048];
-int is_vspaceinvalidating;
-// LAB 4
+
+// Pages kalloc keeps back for callers that cannot wait for a swap-out.
+#define KALLOC_RESERVE 10
+
+// Free pages below which swapd frees memory ahead of demand, and the
+// number it frees up to.
+#define SWAPD_LOW (3 * KALLOC_RESERVE)
+#define SWAPD_HIGH (4 * KALLOC_RESERVE)
 
 struct core_map_entry *pa2page(uint64_t pa) {
   if (PGNUM(pa) >= npages) {
@@ -36,10 +43,6 @@ struct core_map_entry *pa2page(uint64_t pa) {
   return &core_map[PGNUM(pa)];
 }
 
-struct swap_entry *getswapentry(uint64_t spn) {
-  return &swap_map[spn];
-}
-
 uint64_t page2pa(struct core_map_entry *pp) {
   return (pp - core_map) << PT_SHIFT;
 }
@@ -67,6 +70,7 @@ void detect_memory(void) {
 }
 
 void freerange(void *vstart, void *vend);
+static char *kalloc_noswap(void);
 extern char end[]; // first address after kernel loaded from ELF file
 
 struct {
@@ -74,9 +78,12 @@ struct {
   int use_lock;
 } kmem;
 
+// Swap-out and swap-in serialize on lock, which is held across the
+// disk request.
 struct {
   struct sleeplock lock;
-} swap_lock;
+  int hand;                // clock hand over the core map
+} swapper;
 
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
@@ -94,13 +101,7 @@ void mem_init(void *vstart) {
     initlock(&core_map[i].lock, "core_map_entry lock");
   }
 
-  memset(swap_map, 0, PGROUNDUP(2048 * sizeof(struct swap_entry)));
-  for (int i = 0; i < 2048; i++) {
-    swap_map[i].available = 1;
-  }
-  initsleeplock(&swap_lock.lock, "swap lock");
-
-  is_vspaceinvalidating = 0;
+  initsleeplock(&swapper.lock, "swapper");
 
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
@@ -137,8 +138,16 @@ void kfree(char *v) {
 
   acquire(&r->lock);
 
+  // Unmapped while futex waiters are keyed to it: the last of them
+  // frees it, so the frame is not reused under them.
+  if (r->ref_count <= 1 && r->pins > 0) {
+    r->user = 0;
+    r->va = 0;
+    r->vs = 0;
+    r->ref_count = 0;
+
   // There is 1 or less pointers to this page. Delete page.
-  if (r->ref_count <= 1) {
+  } else if (r->ref_count <= 1) {
 
     pages_in_use--;
     free_pages++;
@@ -149,11 +158,15 @@ void kfree(char *v) {
     r->available = 1;
     r->user = 0;
     r->va = 0;
+    r->vs = 0;
     r->ref_count = 0;
 
   // There are multiple pointers to this page. Decrement count.
+  // The remaining sharer is unknown, so the page has no owner until
+  // that address space maps it again.
   } else {
     r->ref_count--;
+    r->vs = 0;
   }
 
   release(&r->lock);
@@ -184,128 +197,322 @@ mark_kernel_mem(uint64_t pa)
   r->va = 0;
 }
 
-uint64_t getavailablespn() {
-  for (int i = 0; i < 2048; i++) {
-    if (swap_map[i].available == 1) {
-      
-      initlock(&swap_map[i].lock, "swap_map lock");
-      acquire(&swap_map[i].lock);
-      swap_map[i].available = 0;
-      release(&swap_map[i].lock);
-      return i;
-    }
+// Tests whether the page at va is a resident, mapped, private user page
+// of vs that has not been referenced since the clock last looked at it.
+// A referenced page gets a second chance: its accessed bit is cleared.
+static int
+swappable(struct vspace *vs, struct vregion *vr, uint64_t va)
+{
+  struct vpage_info *vpi;
+  struct core_map_entry *cme;
+  pte_t *pte;
+
+  // A system call may be using the pages it faulted in, and futex
+  // waiters are keyed to the frame.
+  if (vs->kpins)
+    return 0;
+  // Pages of a shared mapping must stay put for every sharer to see.
+  if (va < VRBOT(vr) || va >= VRTOP(vr) || vr->shared)
+    return 0;
+  vpi = va2vpage_info(vr, va);
+  if (!vpi || !vpi->used || !vpi->present)
+    return 0;
+  cme = pa2page(vpi->ppn << PT_SHIFT);
+  if (cme->available || !cme->user || cme->ref_count != 1 || cme->vs != vs ||
+      cme->pins)
+    return 0;
+
+  pte = walkpml4(vs->pgtbl, (char *)va, 0);
+  if (!pte || !(*pte & PTE_P))
+    return 0;
+  if (*pte & PTE_A) {
+    *pte &= ~PTE_A;
+    if (vs == myproc()->vspace)
+      invlpg((void *)va);
+    return 0;
   }
-  return 0;
+  return 1;
 }
 
-
-int diskread(uint64_t va, uint64_t spn) {
-  for (int i = 0; i < 8; i++) {
-    uchar mem[BSIZE];
-    
-    struct buf *buf = bread(ROOTDEV, spn * 8 + i + 2);
-    memmove(mem, buf->data, BSIZE);
-    brelse(buf);
-    memmove((void*)va + 512 * i, mem, BSIZE);
+// Advances the clock hand over the core map to a swappable page. For
+// the first sweep, only pages of processes whose working set exceeds
+// their share of memory are candidates, so that a process that does
+// not fit pays for it before the others do.
+// The victim's vspace is returned referenced and locked.
+static struct core_map_entry *
+pick_victim(void)
+{
+  struct core_map_entry *cme;
+  struct vspace *vs;
+  struct vregion *vr;
+  int n, share;
+
+  share = wsshare();
+  for (n = 0; n < 3 * npages; n++) {
+    cme = &core_map[swapper.hand];
+    swapper.hand = (swapper.hand + 1) % npages;
+    if (cme->available || !cme->user || !(vs = cme->vs) || cme->ref_count != 1)
+      continue;
+    if (n < npages && vs->stat.wss <= share)
+      continue;
+    // Skip a vspace that is busy rather than wait for it: its owner may
+    // be the one allocating. The page may have changed hands meanwhile.
+    if (!vspaceget(vs))
+      continue;
+    if (!tryacquiresleep(&vs->lock)) {
+      vspaceput(vs);
+      continue;
+    }
+    if (cme->vs == vs && (vr = va2vregion(vs, cme->va)) &&
+        swappable(vs, vr, cme->va))
+      return cme;
+    releasesleep(&vs->lock);
+    vspaceput(vs);
   }
-  acquiresleep(&swap_lock.lock);
-  pages_in_swap--;
-  releasesleep(&swap_lock.lock);
   return 0;
 }
 
-
-int diskwrite(uint64_t va, uint64_t spn) {
-  for (int i = 0; i < 8; i++) {
-    struct buf *buf = bread(ROOTDEV, spn * 8 + i + 2);
-    memmove(buf->data, (void*)va + 512 * i, BSIZE);
-    bwrite(buf);
-    brelse(buf);
+// Frees memory by swapping out a cluster of cold pages: the victim the
+// clock picks plus its virtually contiguous cold neighbours, up to
+// SWAPCLUSTER pages. The cluster goes to contiguous swap slots in one
+// disk request. Returns the number of pages freed.
+static int
+swapout(void)
+{
+  struct core_map_entry *cme;
+  struct vspace *vs;
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  char *pages[SWAPCLUSTER], *pt;
+  int stored[SWAPCLUSTER];
+  uint64_t lo, hi, va, hint;
+  int i, j, n, spn;
+
+  acquiresleep(&swapper.lock);
+  if (!(cme = pick_victim())) {
+    releasesleep(&swapper.lock);
+    return 0;
+  }
+  // The victim's vspace stays locked until its pages are written out.
+  vs = cme->vs;
+  va = lo = hi = cme->va;
+  vr = va2vregion(vs, va);
+
+  // Pages of a huge page go out on their own. The page table for the
+  // split comes from the reserve, as kalloc would recurse into here.
+  if (va2vpage_info(vr, va)->huge) {
+    if (!(pt = kalloc_noswap())) {
+      releasesleep(&vs->lock);
+      vspaceput(vs);
+      releasesleep(&swapper.lock);
+      return 0;
+    }
+    vspacesplit(vs, va, pt);
   }
-  pages_in_swap++;
-  return 0;
-}
 
+  while ((hi - lo) / PGSIZE + 1 < SWAPCLUSTER && swappable(vs, vr, hi + PGSIZE))
+    hi += PGSIZE;
+  while ((hi - lo) / PGSIZE + 1 < SWAPCLUSTER && swappable(vs, vr, lo - PGSIZE))
+    lo -= PGSIZE;
+
+  // Continue the slots of the page before the cluster if it is swapped
+  // out, so a later fault can read both back in one request.
+  hint = -1;
+  if (lo > VRBOT(vr) && (vpi = va2vpage_info(vr, lo - PGSIZE)) &&
+      vpi->used && !vpi->present && vpi->swap == VPI_SWAP)
+    hint = vpi->spn + 1;
+
+  n = (hi - lo) / PGSIZE + 1;
+  i = n;
+  if ((spn = swapalloc(&n, hint)) < 0) {
+    releasesleep(&vs->lock);
+    vspaceput(vs);
+    releasesleep(&swapper.lock);
+    return 0;
+  }
+  // If only a shorter run of slots was free, keep the victim in it.
+  lo += min((va - lo) / PGSIZE, (uint64_t)(i - n)) * PGSIZE;
+
+  for (i = 0; i < n; i++) {
+    va = lo + i * PGSIZE;
+    vpi = va2vpage_info(vr, va);
+    pages[i] = P2V(vpi->ppn << PT_SHIFT);
+
+    vpi->present = 0;
+    vpi->swap = VPI_SWAP;
+    vpi->spn = spn + i;
+    vpi->ppn = 0;
+    vspaceupdate(vs, va);
+  }
+  vs->stat.swapped += n;
+
+  // The owner may be running on another CPU, with the translations
+  // still cached there. Nothing may write the pages once they are
+  // being copied out.
+  tlbshootdown();
+
+  // Pages go to the compressed pool if they fit; runs of the rest are
+  // written to disk.
+  for (i = 0; i < n; i++)
+    stored[i] = zswapstore(spn + i, pages[i]) == 0;
+  for (i = 0; i < n; i = j) {
+    for (; i < n && stored[i]; i++)
+      ;
+    for (j = i; j < n && !stored[j]; j++)
+      ;
+    if (j > i)
+      swapio(spn + i, pages + i, j - i, 1);
+  }
+  releasesleep(&vs->lock);
+  vspaceput(vs);
+  releasesleep(&swapper.lock);
 
-void swapin(uint64_t spn, uint64_t va, uint64_t dst) {
-  diskread(dst, spn);
+  for (i = 0; i < n; i++)
+    kfree(pages[i]);
+  return n;
+}
 
-  acquiresleep(&swap_lock.lock);
-  updatevpages(va, PGNUM(V2P(dst)), VPI_PRESENT, spn, 0);
-  releasesleep(&swap_lock.lock);
+// Returns the vpage_info for va if that page is swapped out to slot spn
+// on disk and nobody else references the slot, so it can be read ahead.
+static struct vpage_info *
+swapneighbour(struct vregion *vr, uint64_t va, uint64_t spn)
+{
+  struct vpage_info *vpi;
+
+  if (va < VRBOT(vr) || va >= VRTOP(vr))
+    return 0;
+  vpi = va2vpage_info(vr, va);
+  if (!vpi || !vpi->used || vpi->present || vpi->swap != VPI_SWAP)
+    return 0;
+  if (vpi->spn != spn || swapref(spn) != 1 || zswapcontains(spn))
+    return 0;
+  return vpi;
 }
 
+// Handles a fault on the swapped-out page at va in region vr of vs.
+// A page in the compressed pool is decompressed without I/O. Otherwise
+// pages of the same region held in the slots right before and after it
+// were most likely evicted in the same cluster, so they are read in by
+// the same disk request. Returns 0 on success, -1 if out of memory.
+int
+swapfault(struct vspace *vs, struct vregion *vr, uint64_t va)
+{
+  char *mem, *spare[SWAPCLUSTER - 1], *pages[SWAPCLUSTER];
+  struct vpage_info *vpi;
+  uint64_t spn;
+  int i, j, nspare, before, after;
+
+  va = PGROUNDDOWN(va);
+  if (!(mem = kalloc()))
+    return -1;
+
+  // Readahead only uses pages that are free without swapping.
+  for (nspare = 0; nspare < SWAPCLUSTER - 1; nspare++)
+    if (free_pages <= KALLOC_RESERVE + SWAPCLUSTER || !(spare[nspare] = kalloc()))
+      break;
+
+  acquiresleep(&swapper.lock);
+  vpi = va2vpage_info(vr, va);
+  if (vpi->present || vpi->swap != VPI_SWAP) {
+    // Swapped in by someone else while we waited for the lock.
+    releasesleep(&swapper.lock);
+    kfree(mem);
+    for (j = 0; j < nspare; j++)
+      kfree(spare[j]);
+    return 0;
+  }
+  spn = vpi->spn;
 
-int evict_i = 0;
+  before = after = j = 0;
+  pages[0] = mem;
+  if (zswapload(spn, mem) == 0) {
+    vs->stat.minflt++;
+  } else {
+    vs->stat.majflt++;
+    while (before + after < nspare && swapadjacent(spn + after) &&
+           swapneighbour(vr, va + (after + 1) * PGSIZE, spn + after + 1))
+      after++;
+    while (before + after < nspare && swapadjacent(spn - before - 1) &&
+           swapneighbour(vr, va - (before + 1) * PGSIZE, spn - before - 1))
+      before++;
+
+    for (i = 0; i < before + 1 + after; i++)
+      pages[i] = i == before ? mem : spare[j++];
+    swapio(spn - before, pages, before + 1 + after, 0);
+  }
 
-uint64_t lru_evict() {
-  evict_i++;
-  uint64_t i = 0;
+  for (i = 0; i < before + 1 + after; i++) {
+    vpi = va2vpage_info(vr, va - before * PGSIZE + i * PGSIZE);
 
-  while (1) {
-    int index = (i + evict_i) % npages;
-    if (core_map[index].available == 0
-        && core_map[index].va != 0
-        && core_map[index].user != 0
-        && vawasaccessed(&myproc()->vspace, core_map[index].va) == 0) {
-      evict_i = index;
-      return index;
+    // Other sharers keep the slot, so this copy is private.
+    if (swapref(vpi->spn) > 1 && vpi->cow) {
+      vpi->writable = VPI_WRITABLE;
+      vpi->cow = 0;
     }
-    release(&core_map[index].lock);
-    evict_i++;
+    swapfree(vpi->spn);
+
+    vpi->ppn = PGNUM(V2P(pages[i]));
+    vpi->present = VPI_PRESENT;
+    vpi->swap = 0;
+    vpi->spn = 0;
   }
+  vs->stat.swapped -= before + 1 + after;
+  releasesleep(&swapper.lock);
+
+  for (; j < nspare; j++)
+    kfree(spare[j]);
 
+  // Mapping may allocate page table pages, so not under the lock.
+  for (i = 0; i < before + 1 + after; i++)
+    vspaceupdate(vs, va - before * PGSIZE + i * PGSIZE);
   return 0;
 }
 
+// Kernel thread that frees memory ahead of demand, so that allocations
+// seldom wait for a swap-out themselves. kalloc wakes it when free
+// pages run below SWAPD_LOW. It gives back cached file pages and
+// swaps out cold ones until SWAPD_HIGH pages are free or nothing more
+// can go, then waits to be woken again.
+//
+// It sleeps under a lock of its own: kmem.lock is taken under
+// ptable.lock when processes are reaped. A wakeup it misses comes
+// again with the next allocation.
+static struct spinlock swapdlock;
+
+static void swapd(void *arg) {
+  acquire(&swapdlock);
+  for (;;) {
+    sleep(&free_pages, &swapdlock);
+    release(&swapdlock);
+    while (free_pages < SWAPD_HIGH && (pcachereclaim() > 0 || swapout() > 0))
+      ;
+    acquire(&swapdlock);
+  }
+}
 
-char *kalloc(void) {
-  while (free_pages < 10 && is_vspaceinvalidating == 0) {
-    // Get an available spn
-    uint64_t spn = getavailablespn();
-
-    // Get cme we want to evict
-    uint64_t i  = lru_evict();
-    struct core_map_entry *cme = &core_map[i];
-
-    // Populate swap_map[spn]
-    acquire(&swap_map[spn].lock);
-    swap_map[spn].user = cme->user;
-    swap_map[spn].va = cme->va;
-    swap_map[spn].ref_count = cme->ref_count;
-    release(&swap_map[spn].lock);
-
-    // Copy page to disk.
-    acquiresleep(&swap_lock.lock);
-    diskwrite((uint64_t) P2V(i << PT_SHIFT), spn);
-    releasesleep(&swap_lock.lock);
-
-    // Set up for kfree
-    acquire(&cme->lock);
-    cme->ref_count = 0;
-    release(&cme->lock);
-
-    // Free the page which is now in disk.
-    kfree(P2V(i << PT_SHIFT));
-
-    // Update the vpages.
-    updatevpages(swap_map[spn].va, i, 0, spn, VPI_SWAP);
-
-    pages_in_use++;
-    free_pages--;
-
-    if (kmem.use_lock)
-      acquire(&kmem.lock);
-    acquire(&core_map[i].lock);
-    core_map[i].available = 0;
-    core_map[i].ref_count = 1;
-    release(&core_map[i].lock);
-    if (kmem.use_lock)
-      release(&kmem.lock);
+void swapdinit(void) {
+  initlock(&swapdlock, "swapd");
+  if (kthread_create(swapd, 0, "swapd") < 0)
+    panic("swapdinit");
+}
 
-    return P2V(page2pa(&core_map[i]));
-  }
+char *kalloc(void) {
+  // Running low: give back cached program pages nobody maps, or else
+  // push a cluster of cold user pages out to swap first. Callers
+  // holding a spinlock, or running before the first process exists,
+  // cannot sleep on the disk and are served from the reserve.
+  if (free_pages < KALLOC_RESERVE && pcachereclaim() == 0 && myproc() &&
+      mycpu()->ncli == 0)
+    swapout();
+  // Getting low: have swapd free memory in the background.
+  else if (free_pages < SWAPD_LOW && myproc() && mycpu()->ncli == 0)
+    wakeup(&free_pages);
+
+  return kalloc_noswap();
+}
 
+// Allocates a page without trying to free memory first.
+static char *kalloc_noswap(void) {
   int i;
 
   if (kmem.use_lock)
@@ -331,3 +538,41 @@ char *kalloc(void) {
     release(&kmem.lock);
   return 0;
 }
+
+// Allocates PTRS_PER_PT physically contiguous pages starting at a
+// PD_SIZE boundary, to back a huge page. Each page is accounted as if
+// it came from kalloc, and is freed on its own with kfree. Huge pages
+// are a luxury: this fails unless the pages are free without swapping.
+// Returns the first page, or 0.
+char *kallochuge(void) {
+  int i, j;
+
+  if (free_pages < PTRS_PER_PT + KALLOC_RESERVE)
+    return 0;
+
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+  for (i = 0; i + PTRS_PER_PT <= npages; i += PTRS_PER_PT) {
+    for (j = 0; j < PTRS_PER_PT && core_map[i + j].available; j++)
+      ;
+    if (j < PTRS_PER_PT)
+      continue;
+
+    for (j = 0; j < PTRS_PER_PT; j++) {
+      acquire(&core_map[i + j].lock);
+      core_map[i + j].available = 0;
+      core_map[i + j].ref_count = 1;
+      release(&core_map[i + j].lock);
+    }
+    pages_in_use += PTRS_PER_PT;
+    free_pages -= PTRS_PER_PT;
+
+    if (kmem.use_lock)
+      release(&kmem.lock);
+    return P2V(page2pa(&core_map[i]));
+  }
+
+  if (kmem.use_lock)
+    release(&kmem.lock);
+  return 0;
+}
@@ -27,12 +27,14 @@
 #define DEASSERT 0x00000000
 #define LEVEL 0x00008000 // Level triggered
 #define BCAST 0x00080000 // Send to all APICs, including self.
+#define OTHERS 0x000C0000 // Send to all APICs, excluding self.
 #define BUSY 0x00001000
 #define FIXED 0x00000000
 #define ICRHI (0x0310 / 4)  // Interrupt Command [63:32]
 #define TIMER (0x0320 / 4)  // Local Vector Table 0 (TIMER)
 #define X1 0x0000000B       // divide counts by 1
 #define PERIODIC 0x00020000 // Periodic
+#define ONESHOT 0x00000000  // One-shot
 #define PCINT (0x0340 / 4)  // Performance Counter LVT
 #define LINT0 (0x0350 / 4)  // Local Vector Table 1 (LINT0)
 #define LINT1 (0x0360 / 4)  // Local Vector Table 2 (LINT1)
@@ -44,6 +46,12 @@
 
 volatile uint *lapic; // Initialized in mp.c
 
+// xk takes the timer to count 10000000 times in a 10 ms tick.
+#define MSCOUNT (10000000 / MSPERTICK)
+
+static uint64_t tscperms; // TSC cycles in a millisecond
+static uint64_t tsc0;     // TSC when the clock started
+
 static void lapicw(int index, int value) {
   lapic[index] = value;
   lapic[ID]; // wait for write to finish, by reading
@@ -56,13 +64,26 @@ void lapicinit(void) {
   // Enable local APIC; set spurious interrupt vector.
   lapicw(SVR, ENABLE | (TRAP_IRQ0 + IRQ_SPURIOUS));
 
-  // The timer repeatedly counts down at bus frequency
-  // from lapic[TICR] and then issues an interrupt.
+  // The timer counts down at bus frequency from lapic[TICR]
+  // and then issues an interrupt.
   // If xk cared more about precise timekeeping,
   // TICR would be calibrated using an external time source.
+  // The boot CPU measures the TSC against it once, to tell the time
+  // with. After that the timer runs one-shot: timerarm sets it for
+  // the next thing that needs doing, so an idle CPU takes no
+  // interrupts until then.
   lapicw(TDCR, X1);
-  lapicw(TIMER, PERIODIC | (TRAP_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  if (!tscperms) {
+    lapicw(TIMER, MASKED);
+    lapicw(TICR, 10 * MSCOUNT);
+    tsc0 = rdtsc();
+    while (lapic[TCCR] != 0)
+      ;
+    tscperms = (rdtsc() - tsc0) / 10;
+    tsc0 = rdtsc();
+  }
+  lapicw(TIMER, ONESHOT | (TRAP_IRQ0 + IRQ_TIMER));
+  lapicw(TICR, MSCOUNT);
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -125,6 +146,28 @@ void lapiceoi(void) {
     lapicw(EOI, 0);
 }
 
+// Sets the timer to interrupt once, ms milliseconds from now.
+void lapicarm(uint ms) {
+  if (lapic)
+    lapicw(TICR, ms * MSCOUNT);
+}
+
+// Returns the milliseconds since the clock started.
+uint lapicms(void) {
+  if (!tscperms)
+    return 0;
+  return (rdtsc() - tsc0) / tscperms;
+}
+
+// Sends interrupt vector to CPU c. Caller must have interrupts off,
+// so that no interrupt handler can send one in between.
+void lapicipi(struct cpu *c, int vector) {
+  lapicw(ICRHI, c->apicid << 24);
+  lapicw(ICRLO, FIXED | vector);
+  while (lapic[ICRLO] & DELIVS)
+    ;
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void microdelay(int us) {}
@@ -167,6 +210,41 @@ void lapicstartap(uchar apicid, uint addr) {
   }
 }
 
+// Makes every other running CPU flush its TLB, and waits until all
+// have, so that page table entries just cleared are no longer used
+// anywhere. The caller must not hold a spinlock: a CPU spinning for
+// it could not take the flush request.
+void tlbshootdown(void) {
+  struct cpu *c, *me;
+  int pending;
+
+  if (!lapic || ncpu == 1)
+    return;
+
+  pushcli();
+  me = mycpu();
+  for (c = cpus; c < &cpus[ncpu]; c++)
+    if (c != me && c->started)
+      c->tlbflush = 1;
+  lapicw(ICRHI, 0);
+  lapicw(ICRLO, OTHERS | FIXED | TRAP_TLBFLUSH);
+  while (lapic[ICRLO] & DELIVS)
+    ;
+
+  do {
+    // Another CPU may be waiting on us meanwhile.
+    if (me->tlbflush) {
+      lcr3(rcr3());
+      me->tlbflush = 0;
+    }
+    pending = 0;
+    for (c = cpus; c < &cpus[ncpu]; c++)
+      if (c != me && c->tlbflush)
+        pending = 1;
+  } while (pending);
+  popcli();
+}
+
 #define CMOS_STATA 0x0a
 #define CMOS_STATB 0x0b
 #define CMOS_UIP (1 << 7) // RTC update in progress
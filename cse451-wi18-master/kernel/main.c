@@ -3,12 +3,23 @@
 #include <defs.h>
 #include <e820.h>
 #include <memlayout.h>
+#include <msr.h>
+#include <param.h>
+#include <proc.h>
 #include <trap.h>
+#include <x86_64.h>
+#include <x86_64vm.h>
 
+static void startothers(void);
 noreturn static void mpmain(void);
 extern char _end[]; // first address after kernel loaded from ELF file
 
 int main(uint64_t addr) {
+  // mycpu() reads %gs, which seginit sets up for real. Until then,
+  // the boot CPU uses cpus[0].
+  cpus[0].cpu = &cpus[0];
+  wrmsr(MSR_IA32_GS_BASE, (uint64_t)&cpus[0].cpu);
+
   e820_init(addr);
   detect_memory();
   mem_init(_end); // phys page allocator
@@ -25,21 +36,72 @@ int main(uint64_t addr) {
   cprintf("free pages: %d\n", free_pages);
   pinit();
   finit(); // initialize lock for global file table 
+  shminit(); // shared memory segments
+  futexinit(); // futex wait queues
   tvinit();   // trap vectors
   binit();    // buffer cache
   ideinit();  // disk
   userinit(); // first user process
+  swapdinit(); // background reclaim
 // LAB5
 //  log_recover();
 // LAB5
+  startothers(); // start other processors
   mpmain();
   return 0;
 }
 
+// Other CPUs jump here from entryother.S, through entry.S.
+void mpenter(void) {
+  vspaceinstallkern();
+  seginit();
+  lapicinit();
+  mpmain();
+}
+
 // Common CPU setup code.
 static void mpmain(void) {
   cprintf("cpu%d: starting\n", cpunum());
   idtinit(); // load idt register
-  // xchg(&cpu->started, 1); // tell startothers() we're up
+  xchg(&mycpu()->started, 1); // tell startothers() we're up
   scheduler(); // start running processes
 }
+
+// Start the non-boot (AP) processors.
+static void startothers(void) {
+  extern uchar _binary_out_entryother_start[], _binary_out_entryother_size[];
+  extern char start_common[];
+  uchar *code;
+  struct cpu *c;
+  char *stack;
+
+  // entry.S tells the boot CPU from the others by a cpu number of 0.
+  if (mycpu() != &cpus[0])
+    panic("startothers: boot cpu is not cpu 0");
+
+  // Write entry code to unused memory at AP_ENTRY.
+  // The linker has placed the image of entryother.S in
+  // _binary_out_entryother_start.
+  code = P2V(AP_ENTRY);
+  memmove(code, _binary_out_entryother_start,
+          (uint64_t)_binary_out_entryother_size);
+
+  for (c = cpus; c < &cpus[ncpu]; c++) {
+    if (c == mycpu()) // We've started already.
+      continue;
+
+    // Tell entryother.S what cpu it is, what stack to use, and where
+    // to go next.
+    if (!(stack = kalloc()))
+      panic("startothers: out of memory");
+    *(uint *)(code - AP_OFFSET_CPUNUM) = c - cpus;
+    *(uint *)(code - AP_OFFSET_STACK) = V2P(stack) + KSTACKSIZE;
+    *(uint *)(code - AP_OFFSET_ENTRY) = V2P(start_common);
+
+    lapicstartap(c->apicid, V2P(code));
+
+    // wait for cpu to finish mpmain()
+    while (c->started == 0)
+      ;
+  }
+}
@@ -41,11 +41,25 @@ void iderw(struct buf *b) {
     panic("iderw: nothing to do");
   if (b->dev != 1)
     panic("iderw: request not for disk 1");
-  if (b->blockno >= disksize)
+  if (b->blockno >= disksize || (b->pages && b->blockno + b->nsect > disksize))
     panic("iderw: block out of range");
 
   p = memdisk + b->blockno * BSIZE;
 
+  if (b->pages) {
+    for (b->sect = 0; b->sect < b->nsect; b->sect++, p += BSIZE) {
+      uchar *q = (uchar *)b->pages[b->sect / (PGSIZE / BSIZE)] +
+                 (b->sect % (PGSIZE / BSIZE)) * BSIZE;
+      if (b->flags & B_DIRTY)
+        memmove(p, q, BSIZE);
+      else
+        memmove(q, p, BSIZE);
+    }
+    b->flags &= ~B_DIRTY;
+    b->flags |= B_VALID;
+    return;
+  }
+
   if (b->flags & B_DIRTY) {
     b->flags &= ~B_DIRTY;
     memmove(p, b->data, BSIZE);
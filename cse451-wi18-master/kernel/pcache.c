@@ -0,0 +1,285 @@
+// File page cache.
+//
+// Keeps the pages of files that exec and mmap map, keyed by file and
+// offset, so that every process running the same binary or mapping
+// the same file maps the same frames. A page is handed out with a
+// reference of its own. Program text and private mappings map it
+// copy-on-write, so a process that writes to one gets a private copy.
+// Shared mappings map it writable: their writes are seen by every
+// other sharer at once, and reach the file when msync writes the
+// page back.
+//
+// The cache holds one reference to each of its pages. Pages nobody
+// else maps are given back when memory runs low, and make room first
+// when the cache is full. A page a shared mapping maps is never
+// dropped, as later mappers must get the same frame; the cache grows
+// past NPCACHE pages instead if it has to. write() to a file drops its
+// other pages, and copies the data into the shared ones.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <file.h>
+#include <fs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+#include <sysinfo.h>
+
+struct pcentry {
+  uint dev;
+  uint inum;
+  uint off;     // file offset of the data; the page is zero past EOF
+  uint seq;     // insertion order; the smallest is evicted first
+  int shared;   // mapped by a shared mapping since it was last unmapped
+  char *page;
+  struct pcentry *next;
+};
+
+#define PCPERPG (PGSIZE / sizeof(struct pcentry))
+
+struct {
+  struct spinlock lock;
+  struct pcentry *head;   // cached pages
+  struct pcentry *free;   // unused entries
+  struct pcentry entries[NPCACHE];
+  int n;                  // cached pages
+  uint seq;
+  uint gen;               // bumped when file contents change
+  int hits;
+  int misses;
+} pcache;
+
+void
+pcacheinit(void)
+{
+  int i;
+
+  initlock(&pcache.lock, "pcache");
+  for (i = 0; i < NPCACHE; i++) {
+    pcache.entries[i].next = pcache.free;
+    pcache.free = &pcache.entries[i];
+  }
+}
+
+static void
+pageref(char *page)
+{
+  struct core_map_entry *cme = pa2page(V2P(page));
+
+  acquire(&cme->lock);
+  cme->ref_count++;
+  release(&cme->lock);
+}
+
+// Tests whether a process maps the page of e.
+static inline int
+mapped(struct pcentry *e)
+{
+  return pa2page(V2P(e->page))->ref_count > 1;
+}
+
+// Tests whether a shared mapping may map the page of e, so that it
+// must stay in the cache. Caller must hold pcache.lock.
+static int
+pinned(struct pcentry *e)
+{
+  if (e->shared && !mapped(e))
+    e->shared = 0;
+  return e->shared;
+}
+
+// Returns the entry caching the page at off in ip, or 0. Caller must
+// hold pcache.lock.
+static struct pcentry *
+lookup(struct inode *ip, uint off)
+{
+  struct pcentry *e;
+
+  for (e = pcache.head; e; e = e->next)
+    if (e->dev == ip->dev && e->inum == ip->inum && e->off == off)
+      return e;
+  return 0;
+}
+
+// Drops the cache's reference to the page of *pp and frees its entry.
+// Caller must hold pcache.lock.
+static void
+drop(struct pcentry **pp)
+{
+  struct pcentry *e = *pp;
+
+  *pp = e->next;
+  kfree(e->page);
+  e->page = 0;
+  e->next = pcache.free;
+  pcache.free = e;
+  pcache.n--;
+}
+
+// Returns the page at off in ip, zero past the end of the file, with a
+// reference for the caller, who must not write to it unless it maps
+// the file shared, as it must say. Sets *cached if the page was in the
+// cache already. Returns 0 if out of memory or the file cannot be read.
+char *
+pcacheget(struct inode *ip, uint off, int shared, int *cached)
+{
+  struct pcentry *e, **pp, **victim;
+  char *mem, *spare;
+  uint gen, len;
+  int i, grow;
+
+again:
+  acquire(&pcache.lock);
+  if ((e = lookup(ip, off))) {
+    pageref(e->page);
+    e->shared |= shared;
+    pcache.hits++;
+    release(&pcache.lock);
+    *cached = 1;
+    return e->page;
+  }
+  pcache.misses++;
+  gen = pcache.gen;
+  grow = !pcache.free;
+  release(&pcache.lock);
+  *cached = 0;
+
+  // Entries for a cache that has outgrown its table come a page at a
+  // time.
+  spare = 0;
+  if (grow && !(spare = kalloc()))
+    return 0;
+  if (!(mem = kalloc())) {
+    if (spare)
+      kfree(spare);
+    return 0;
+  }
+  memset(mem, 0, PGSIZE);
+  len = off < ip->size ? min(ip->size - off, (uint)PGSIZE) : 0;
+  if (len && readi(ip, mem, off, len) != len) {
+    kfree(mem);
+    if (spare)
+      kfree(spare);
+    return 0;
+  }
+
+  acquire(&pcache.lock);
+  if (pcache.gen != gen || (e = lookup(ip, off))) {
+    // The file changed while it was read, or someone else read it in
+    // meanwhile.
+    release(&pcache.lock);
+    kfree(mem);
+    if (spare)
+      kfree(spare);
+    goto again;
+  }
+
+  // When full, make room by dropping the oldest page nobody maps, else
+  // the oldest page no shared mapping maps.
+  if (pcache.n >= NPCACHE) {
+    victim = 0;
+    for (pp = &pcache.head; (e = *pp); pp = &e->next) {
+      if (pinned(e))
+        continue;
+      if (!victim || mapped(e) < mapped(*victim) ||
+          (mapped(e) == mapped(*victim) && (int)(e->seq - (*victim)->seq) < 0))
+        victim = pp;
+    }
+    if (victim)
+      drop(victim);
+  }
+  if (!pcache.free && spare) {
+    for (i = 0; i < PCPERPG; i++) {
+      e = (struct pcentry *)spare + i;
+      e->next = pcache.free;
+      pcache.free = e;
+    }
+    spare = 0;
+  }
+  if (!pcache.free) {
+    // Grown by someone else meanwhile, and used up again.
+    release(&pcache.lock);
+    kfree(mem);
+    if (spare)
+      kfree(spare);
+    goto again;
+  }
+
+  e = pcache.free;
+  pcache.free = e->next;
+  e->dev = ip->dev;
+  e->inum = ip->inum;
+  e->off = off;
+  e->seq = pcache.seq++;
+  e->shared = shared;
+  e->page = mem;
+  e->next = pcache.head;
+  pcache.head = e;
+  pcache.n++;
+  pageref(mem);
+  release(&pcache.lock);
+  if (spare)
+    kfree(spare);
+  return mem;
+}
+
+// Brings the cache up to date with a write of the n bytes at src to
+// off in ip. Pages a shared mapping maps get the new data in place, so
+// that its sharers see it; the others are dropped, and processes that
+// map them keep them. Caller must hold ip's lock.
+void
+pcachewrite(struct inode *ip, char *src, uint off, uint n)
+{
+  struct pcentry *e, **pp;
+  uint lo, hi;
+
+  acquire(&pcache.lock);
+  pcache.gen++;
+  for (pp = &pcache.head; (e = *pp);) {
+    if (e->dev != ip->dev || e->inum != ip->inum) {
+      pp = &e->next;
+      continue;
+    }
+    if (!pinned(e)) {
+      drop(pp);
+      continue;
+    }
+    lo = max(off, e->off);
+    hi = min(off + n, e->off + PGSIZE);
+    if (lo < hi)
+      memmove(e->page + (lo - e->off), src + (lo - off), hi - lo);
+    pp = &e->next;
+  }
+  release(&pcache.lock);
+}
+
+// Frees the cached pages no process maps. Returns how many.
+int
+pcachereclaim(void)
+{
+  struct pcentry *e, **pp;
+  int n = 0;
+
+  acquire(&pcache.lock);
+  for (pp = &pcache.head; (e = *pp);) {
+    if (!mapped(e)) {
+      drop(pp);
+      n++;
+    } else
+      pp = &e->next;
+  }
+  release(&pcache.lock);
+  return n;
+}
+
+void
+pcachestat(struct sys_info *info)
+{
+  acquire(&pcache.lock);
+  info->pcache_pages = pcache.n;
+  info->pcache_hits = pcache.hits;
+  info->pcache_misses = pcache.misses;
+  release(&pcache.lock);
+}
@@ -6,19 +6,26 @@
 #include <mmu.h>
 #include <param.h>
 #include <proc.h>
+#include <spawn.h>
 #include <spinlock.h>
+#include <sysinfo.h>
 #include <trap.h>
 #include <x86_64.h>
-#include <fs.h>
-#include <file.h>
+#include <mman.h>
 #include <vspace.h>
 
-extern int is_vspaceinvalidating;
+#define WAITQBITS 6
+#define NWAITQ (1 << WAITQBITS) // wait queue buckets
 
 // process table
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  // Sleeping processes, linked into the bucket their chan hashes to,
+  // so that wakeup looks only at processes that may be waiting on it.
+  struct proc *waitq[NWAITQ];
+  // Open file tables; the threads of a process share one.
+  struct fdtable fdtables[NPROC];
 } ptable;
 
 static struct proc *initproc;
@@ -26,6 +33,7 @@ static struct proc *initproc;
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
+static void kthreadmain(void);
 
 static void wakeup1(void *chan);
 
@@ -43,6 +51,161 @@ loop:
 
 void pinit(void) { initlock(&ptable.lock, "ptable"); }
 
+// Returns the wait queue of processes sleeping on chan.
+static struct proc **waitq(void *chan) {
+  // Fibonacci hashing: the top bits of the product depend on every
+  // bit of the address.
+  return &ptable.waitq[((uint64_t)chan * 0x9E3779B97F4A7C15ull) >>
+                       (64 - WAITQBITS)];
+}
+
+// Run queues.
+//
+// Each CPU keeps its runnable processes in queues of its own, one per
+// priority level, oldest first, linked through rqnext, so that
+// choosing the next process to run costs the same however large the
+// process table is. A process
+// goes back on the queue of the CPU it last ran on, where its cache is
+// warm, unless its affinity hint names another CPU. A new process goes
+// on the shortest queue. A CPU with nothing to run steals the oldest
+// process of the longest queue. ptable.lock guards the queues along
+// with process state; it is held only for a constant number of steps
+// per context switch.
+//
+// Priorities follow a multi-level feedback queue. A CPU runs the
+// oldest process of the highest level it has. A process starts at
+// level 0 and drops a level each time it uses up the quantum of its
+// level, so CPU-bound processes sink while those that mostly wait,
+// like the shell, stay near the top. Waking from sleep raises a
+// process a level, and every BOOSTTICKS all processes return to level
+// 0 so that none starves.
+
+// Milliseconds a process may run at each level before dropping a
+// level.
+static const uint quantum[NPRIO] = {1 * MSPERTICK, 2 * MSPERTICK,
+                                    4 * MSPERTICK, 8 * MSPERTICK};
+
+// Chooses the CPU whose run queue p joins. Caller must hold
+// ptable.lock.
+static struct cpu *runqpick(struct proc *p) {
+  struct cpu *c, *best;
+
+  if (p->affinity >= 0 && cpus[p->affinity].started)
+    return &cpus[p->affinity];
+  if (p->cpu)
+    return p->cpu;
+  best = mycpu();
+  for (c = cpus; c < &cpus[ncpu]; c++)
+    if (c->started && c->nrunnable < best->nrunnable)
+      best = c;
+  return best;
+}
+
+// Interrupts c to have it look at its run queue. Caller must hold
+// ptable.lock.
+static void kick(struct cpu *c) {
+  c->idle = 0;
+  if (c != mycpu())
+    lapicipi(c, TRAP_RESCHED);
+}
+
+// Marks p runnable and appends it to a run queue. Wakes the CPU if it
+// is idle, or has it preempt a process of a lower level; failing
+// that, wakes an idle CPU to steal p if it would wait. Caller must
+// hold ptable.lock.
+static void runqadd(struct proc *p) {
+  struct cpu *c = runqpick(p);
+
+  p->state = RUNNABLE;
+  p->cpu = c;
+  p->rqnext = 0;
+  if (c->runqtail[p->prio])
+    c->runqtail[p->prio]->rqnext = p;
+  else
+    c->runq[p->prio] = p;
+  c->runqtail[p->prio] = p;
+  c->nrunnable++;
+
+  if (c->idle) {
+    kick(c);
+  } else if (c->proc && c->proc->prio > p->prio) {
+    c->resched = 1;
+    kick(c);
+  } else if (c->nrunnable > 1 || (c->proc && c->proc != p)) {
+    for (c = cpus; c < &cpus[ncpu]; c++) {
+      if (c->idle) {
+        kick(c);
+        break;
+      }
+    }
+  }
+}
+
+// Returns the process c would run next, or 0 if its run queue is
+// empty. Caller must hold ptable.lock.
+static struct proc *runqpeek(struct cpu *c) {
+  int i;
+
+  for (i = 0; i < NPRIO; i++)
+    if (c->runq[i])
+      return c->runq[i];
+  return 0;
+}
+
+// Removes and returns the process c would run next, or 0 if its run
+// queue is empty. Caller must hold ptable.lock.
+static struct proc *runqpop(struct cpu *c) {
+  struct proc *p = runqpeek(c);
+
+  if (!p)
+    return 0;
+  if (!(c->runq[p->prio] = p->rqnext))
+    c->runqtail[p->prio] = 0;
+  c->nrunnable--;
+  return p;
+}
+
+// Takes p, which is runnable, off its run queue. Caller must hold
+// ptable.lock.
+static void runqremove(struct proc *p) {
+  struct cpu *c = p->cpu;
+  struct proc **pp, *prev = 0;
+
+  for (pp = &c->runq[p->prio]; *pp != p; pp = &(*pp)->rqnext)
+    prev = *pp;
+  *pp = p->rqnext;
+  if (c->runqtail[p->prio] == p)
+    c->runqtail[p->prio] = prev;
+  c->nrunnable--;
+}
+
+// Takes p, which is sleeping, off its wait queue and makes it runnable
+// a level higher. Caller must hold ptable.lock.
+static void runqwake(struct proc *p) {
+  if ((*p->waitprev = p->waitnext))
+    p->waitnext->waitprev = p->waitprev;
+  if (p->prio > 0)
+    p->prio--;
+  p->slice = 0;
+  runqadd(p);
+}
+
+// Takes the oldest process of the longest other run queue for c to
+// run, or returns 0 if there is none. A process whose affinity hint
+// names its own CPU is left there. Caller must hold ptable.lock.
+static struct proc *runqsteal(struct cpu *c) {
+  struct cpu *v, *busiest = 0;
+  struct proc *p;
+
+  for (v = cpus; v < &cpus[ncpu]; v++) {
+    if (v == c || !(p = runqpeek(v)) || p->affinity == v - cpus)
+      continue;
+    if (!busiest || v->nrunnable > busiest->nrunnable)
+      busiest = v;
+  }
+  return busiest ? runqpop(busiest) : 0;
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, change state to EMBRYO and initialize
 // state required to run in the kernel.
@@ -63,6 +226,15 @@ static struct proc *allocproc(void) {
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->cpu = 0;
+  p->affinity = -1;
+  p->prio = 0;
+  p->slice = 0;
+  p->kfn = 0;
+  p->vspace = &kvspace; // until it is given one of its own
+  p->fdtable = 0;
+  p->ustack = 0;
+  p->pinned = 0;
 
   release(&ptable.lock);
 
@@ -90,6 +262,30 @@ found:
   return p;
 }
 
+// Gives back p, fresh from allocproc, when it cannot be set up.
+static void freeproc(struct proc *p) {
+  kfree(p->kstack);
+  p->kstack = 0;
+  acquire(&ptable.lock);
+  p->state = UNUSED;
+  release(&ptable.lock);
+}
+
+// Returns an empty file table holding one reference. Caller must hold
+// ptable.lock. There is one for every process that can exist.
+static struct fdtable *fdtablealloc(void) {
+  struct fdtable *t;
+
+  for (t = ptable.fdtables; t < &ptable.fdtables[NPROC]; t++) {
+    if (t->ref == 0) {
+      t->ref = 1;
+      memset(t->fd, 0, sizeof(t->fd));
+      return t;
+    }
+  }
+  panic("fdtablealloc");
+}
+
 // Set up first user process.
 void userinit(void) {
   struct proc *p;
@@ -98,14 +294,14 @@ void userinit(void) {
   p = allocproc();
 
   initproc = p;
-  assertm(vspaceinit(&p->vspace) == 0, "error initializing process's virtual address descriptor");
-  vspaceinitcode(&p->vspace, _binary_out_initcode_start, (int64_t)_binary_out_initcode_size);
+  assertm((p->vspace = vspacealloc()) != 0, "error initializing process's virtual address descriptor");
+  vspaceinitcode(p->vspace, _binary_out_initcode_start, (int64_t)_binary_out_initcode_size);
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ss = (SEG_UDATA << 3) | DPL_USER;
   p->tf->rflags = FLAGS_IF;
-  p->tf->rip = VRBOT(&p->vspace.regions[VR_CODE]);  // beginning of initcode.S
-  p->tf->rsp = VRTOP(&p->vspace.regions[VR_USTACK]);
+  p->tf->rip = VRBOT(&p->vspace->regions[VR_CODE]);  // beginning of initcode.S
+  p->tf->rsp = VRTOP(&p->vspace->regions[VR_USTACK]);
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
 
@@ -114,13 +310,13 @@ void userinit(void) {
   // writes to be visible, and the lock is also needed
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
-  p->state = RUNNABLE;
+  p->fdtable = fdtablealloc();
+  runqadd(p);
   release(&ptable.lock);
 }
 
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
-// Caller must set state of returned proc to RUNNABLE.
 int fork(void) {
   // your code here
   struct proc *p;
@@ -130,21 +326,37 @@ int fork(void) {
     return -1;
   }
 
-  assertm(vspaceinit(&p->vspace) == 0, "error in fork vspaceint");
-  assertm(vspaceshallowcopy(&p->vspace, &myproc()->vspace) == 0, "error forking");
-  vspaceinvalidate(&myproc()->vspace);
+  if ((p->vspace = vspacealloc()) == 0) {
+    freeproc(p);
+    return -1;
+  }
+  // The child's lock keeps the swapper off its pages while they are
+  // set up, as exec does.
+  acquiresleep(&myproc()->vspace->lock);
+  acquiresleep(&p->vspace->lock);
+  assertm(vspaceshallowcopy(p->vspace, myproc()->vspace) == 0, "error forking");
+  releasesleep(&p->vspace->lock);
+  vspaceinvalidate(myproc()->vspace);
   vspaceinstall(myproc());
+  // Other threads may still hold the pages writable in their TLBs;
+  // until they drop them, their writes would reach the child.
+  if (myproc()->vspace->ref > 1)
+    tlbshootdown();
+  releasesleep(&myproc()->vspace->lock);
 
   // copy parent trap frame into child trap frame
   memmove(p->tf, myproc()->tf, sizeof(struct trap_frame));
 
   // copy parent proc's file table, updating ref count
+  acquire(&ptable.lock);
+  p->fdtable = fdtablealloc();
+  release(&ptable.lock);
   for (int i = 0; i < NOFILE; i++) {
     acquire(&ptable.lock);
-    if (myproc()->file_table[i] != NULL) {
+    if (myproc()->fdtable->fd[i] != NULL) {
 
-      p->file_table[i] = &(*(myproc()->file_table[i]));
-      p->file_table[i]->ref_count++;     
+      p->fdtable->fd[i] = &(*(myproc()->fdtable->fd[i]));
+      p->fdtable->fd[i]->ref_count++;     
 
     }
     release(&ptable.lock);
@@ -153,24 +365,205 @@ int fork(void) {
   // set child proc as runnable and return values for each proc
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
   p->parent = myproc();
+  p->affinity = myproc()->affinity;
   p->tf->rax = 0;
+  runqadd(p);
 
   release(&ptable.lock);
 
   return p->pid;
 }
 
+// Applies the nfa spawn actions fa to the open files of p. Returns 0,
+// or -1 at the first bad one.
+static int spawnfiles(struct proc *p, struct spawn_action *fa, int nfa) {
+  struct fdtable *ft = p->fdtable;
+  int r = 0;
+
+  acquire(&ftable.lock);
+  for (; nfa > 0 && r == 0; fa++, nfa--) {
+    if (fa->fd < 0 || fa->fd >= NOFILE || !ft->fd[fa->fd])
+      r = -1;
+    else if (fa->op == SPAWN_CLOSE)
+      fileclose(p, ft->fd[fa->fd], fa->fd);
+    else if (fa->op != SPAWN_DUP2 || fa->newfd < 0 || fa->newfd >= NOFILE)
+      r = -1;
+    else if (fa->newfd != fa->fd) {
+      if (ft->fd[fa->newfd])
+        fileclose(p, ft->fd[fa->newfd], fa->newfd);
+      ft->fd[fa->newfd] = ft->fd[fa->fd];
+      ft->fd[fa->newfd]->ref_count++;
+    }
+  }
+  release(&ftable.lock);
+  return r;
+}
+
+// Starts the program at path with the n arguments argv in a new child
+// process, without copying the caller's address space as fork and
+// exec would. The child gets a copy of the caller's open files, changed
+// by the nfa actions fa. Returns its pid, or -1.
+int spawn(char *path, int n, char **argv, struct spawn_action *fa, int nfa) {
+  struct proc *p;
+  struct fdtable *ft;
+  int i, r;
+
+  if ((p = allocproc()) == 0)
+    return -1;
+  if ((p->vspace = vspacealloc()) == 0) {
+    freeproc(p);
+    return -1;
+  }
+  memmove(p->tf, myproc()->tf, sizeof(struct trap_frame));
+  acquiresleep(&p->vspace->lock);
+  r = execload(p->vspace, n, path, argv, p->tf);
+  releasesleep(&p->vspace->lock);
+  if (r < 0)
+    goto bad;
+
+  acquire(&ptable.lock);
+  ft = p->fdtable = fdtablealloc();
+  for (i = 0; i < NOFILE; i++) {
+    if ((ft->fd[i] = myproc()->fdtable->fd[i]))
+      ft->fd[i]->ref_count++;
+  }
+  release(&ptable.lock);
+
+  if (spawnfiles(p, fa, nfa) < 0)
+    goto bad;
+
+  safestrcpy(p->name, path, sizeof(p->name));
+  acquire(&ptable.lock);
+  p->parent = myproc();
+  p->affinity = myproc()->affinity;
+  n = p->pid;
+  runqadd(p);
+  release(&ptable.lock);
+  return n;
+
+bad:
+  if ((ft = p->fdtable)) {
+    for (i = 0; i < NOFILE; i++) {
+      if (ft->fd[i])
+        fileclose(p, ft->fd[i], i);
+    }
+    acquire(&ptable.lock);
+    ft->ref = 0;
+    release(&ptable.lock);
+  }
+  vspacerelease(p->vspace);
+  freeproc(p);
+  return -1;
+}
+
+// Starts a thread of the current process at entry(a0, a1), on a stack
+// of TSTACKSIZE bytes mapped for it. It shares the address space and
+// the open files; its exit ends only it, and the caller reclaims it
+// with thread_join or wait. Returns its pid, or -1.
+int clone(uint64_t entry, uint64_t a0, uint64_t a1) {
+  struct proc *p, *cur = myproc();
+  int stack, pid;
+
+  if ((p = allocproc()) == 0)
+    return -1;
+
+  acquiresleep(&cur->vspace->lock);
+  stack = vspacemmap(cur->vspace, TSTACKSIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  releasesleep(&cur->vspace->lock);
+  if (stack == -1) {
+    freeproc(p);
+    return -1;
+  }
+  p->ustack = stack;
+  p->vspace = vspacedup(cur->vspace);
+
+  // Enter as if called, with a zero return address on the stack.
+  memmove(p->tf, cur->tf, sizeof(struct trap_frame));
+  p->tf->rip = entry;
+  p->tf->rdi = a0;
+  p->tf->rsi = a1;
+  p->tf->rsp = stack + TSTACKSIZE - 8;
+  safestrcpy(p->name, cur->name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->fdtable = cur->fdtable;
+  p->fdtable->ref++;
+  p->parent = cur;
+  p->affinity = cur->affinity;
+  pid = p->pid;
+  runqadd(p);
+  release(&ptable.lock);
+  return pid;
+}
+
+// Starts a kernel thread running fn(arg), called name. It runs only in
+// the kernel, on the kernel page table, with no user address space,
+// and is scheduled like any process. It exits when fn returns, and
+// init reaps it. Returns its pid, or -1.
+int kthread_create(void (*fn)(void *), void *arg, char *name) {
+  struct proc *p;
+  int pid;
+
+  if ((p = allocproc()) == 0)
+    return -1;
+
+  p->context->rip = (uint64_t)kthreadmain;
+  p->kfn = fn;
+  p->karg = arg;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  pid = p->pid;
+  p->parent = initproc;
+  runqadd(p);
+  release(&ptable.lock);
+  return pid;
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
 void exit(void) {
-  // close all files on this process
-  for (int i = 0; i < NOFILE; i++) {
-    if (myproc()->file_table[i] != NULL) {
-      fileclose(myproc(), myproc()->file_table[i], i);
+  struct fdtable *ft = myproc()->fdtable;
+  struct vspace *vs = myproc()->vspace;
+  int last;
+
+  // close all files on this process, unless other threads still use
+  // them. The table stays taken until they are closed.
+  if (ft) {
+    acquire(&ptable.lock);
+    if (!(last = ft->ref == 1))
+      ft->ref--;
+    release(&ptable.lock);
+    if (last) {
+      for (int i = 0; i < NOFILE; i++) {
+        if (ft->fd[i] != NULL) {
+          fileclose(myproc(), ft->fd[i], i);
+        }
+      }
+      acquire(&ptable.lock);
+      ft->ref = 0;
+      release(&ptable.lock);
     }
+    myproc()->fdtable = 0;
+  }
+
+  // Drop the thread's stack, then the address space, freeing it and
+  // writing shared file pages back if no other thread uses it. This
+  // runs on the kernel page table from here on.
+  if (vs != &kvspace) {
+    faultindone();
+    if (myproc()->ustack) {
+      acquiresleep(&vs->lock);
+      vspacemunmap(vs, myproc()->ustack, TSTACKSIZE);
+      releasesleep(&vs->lock);
+      tlbshootdown();
+    }
+    myproc()->vspace = &kvspace;
+    vspaceinstallkern();
+    vspacerelease(vs);
   }
 
   // wakeup parent, setting child state to zombie, and scheduling it
@@ -178,7 +571,7 @@ void exit(void) {
   // search through proc table for any children for this proc.
   // if any, change parent to initproc and wake up initproc
   for (int i = 0; i < NPROC; i++) {
-    if (ptable.proc[i].parent->pid == myproc()->pid) {
+    if (ptable.proc[i].parent == myproc()) {
       ptable.proc[i].parent = initproc;
       if (initproc->state == SLEEPING)
         wakeup1(initproc);
@@ -192,29 +585,30 @@ void exit(void) {
 
 }
 
+// Frees the zombie p, whose files and address space exit gave up.
+// Caller must hold ptable.lock.
+static void reap(struct proc *p) {
+  p->state = UNUSED;
+  kfree(p->kstack);
+  p->kstack = 0;
+  p->vspace = 0;
+  p->parent = 0;
+  p->pid = 0;
+  p->killed = 0;
+}
+
 // Looks through the proc table for a zombie child
 // if found, reclaims the resources and returns the child pid
 // if not found, returns -1.
 int process_zombie_child(void) {
   for (int i = 0; i < NPROC; i++) {
 
-     if (ptable.proc[i].parent->pid == myproc()->pid &&
+     if (ptable.proc[i].parent == myproc() &&
          ptable.proc[i].state == ZOMBIE) {
 
        int child_pid = ptable.proc[i].pid;
 
-       for (int j = 0; j < NOFILE; j++) {
-         if (ptable.proc[i].file_table[j] != NULL) {
-           fileclose(&ptable.proc[i], ptable.proc[i].file_table[j], i);
-         }
-       }
-       ptable.proc[i].state = UNUSED;
-       vspacefree(&ptable.proc[i].vspace);
-       kfree(ptable.proc[i].kstack);
-       ptable.proc[i].kstack = 0;
-       ptable.proc[i].parent = 0;
-       ptable.proc[i].pid = 0;
-       ptable.proc[i].killed = 0;
+       reap(&ptable.proc[i]);
        release(&ptable.lock);
        return child_pid;
     }
@@ -232,7 +626,7 @@ int wait(void) {
   for (int i = 0; i < NPROC; i++) {
     acquire(&ptable.lock);
 
-    if (ptable.proc[i].parent->pid == myproc()->pid &&
+    if (ptable.proc[i].parent == myproc() &&
         ptable.proc[i].state != UNUSED) {
       has_child = 1;
     }
@@ -258,39 +652,80 @@ int wait(void) {
   }
 }
 
+// Waits for tid, a thread or child process of the caller, to exit,
+// and reclaims it. Returns tid, or -1 if it is no child of the caller.
+int thread_join(int tid) {
+  struct proc *p;
+
+  acquire(&ptable.lock);
+  for (;;) {
+    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+      if (p->pid == tid && p->parent == myproc() && p->state != UNUSED)
+        break;
+    if (p == &ptable.proc[NPROC] || myproc()->killed) {
+      release(&ptable.lock);
+      return -1;
+    }
+    if (p->state == ZOMBIE) {
+      reap(p);
+      release(&ptable.lock);
+      return tid;
+    }
+    sleep(myproc(), &ptable.lock);
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - take a process from this CPU's run queue, or
+//      steal one from another CPU's, or else halt
+//      until an interrupt
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
 void scheduler(void) {
+  struct cpu *c = mycpu();
   struct proc *p;
 
   for (;;) {
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
     acquire(&ptable.lock);
-    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-      if (p->state != RUNNABLE)
-        continue;
+    if (!(p = runqpop(c)) && !(p = runqsteal(c))) {
+      // Nothing to run: halt until an interrupt, with the timer set
+      // for the next timer due. runqadd clears idle before it
+      // interrupts an idle CPU, so checking it with interrupts off
+      // cannot miss that; sti takes effect only after hlt.
+      c->idle = 1;
+      timerarm(MAXIDLEMS);
+      release(&ptable.lock);
+      cli();
+      if (c->idle)
+        asm volatile("sti; hlt");
+      c->idle = 0;
+      continue;
+    }
 
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      mycpu()->proc = p;
-      vspaceinstall(p);
-      p->state = RUNNING;
-      swtch(&mycpu()->scheduler, p->context);
+    // Switch to chosen process.  It is the process's job
+    // to release ptable.lock and then reacquire it
+    // before jumping back to us.
+    c->proc = p;
+    p->cpu = c;
+    c->runstart = lapicms();
+    timerarm(quantum[p->prio] - p->slice);
+    if (p->vspace == &kvspace)
       vspaceinstallkern();
+    else
+      vspaceinstall(p);
+    p->state = RUNNING;
+    swtch(&c->scheduler, p->context);
+    vspaceinstallkern();
 
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      mycpu()->proc = 0;
-    }
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
     release(&ptable.lock);
   }
 }
@@ -327,11 +762,70 @@ void sched(void) {
 // Give up the CPU for one scheduling round.
 void yield(void) {
   acquire(&ptable.lock); // DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  runqadd(myproc());
+  sched();
+  release(&ptable.lock);
+}
+
+// Charges the current process for the time it has run. It gives up
+// the CPU if that uses up its quantum, dropping a level, or if a
+// process of a higher level is waiting on this CPU. Otherwise the
+// timer is set for the end of its quantum.
+void schedtick(void) {
+  struct cpu *c = mycpu();
+  struct proc *p = c->proc;
+  uint now = lapicms();
+  int i;
+
+  acquire(&ptable.lock);
+  c->resched = 0;
+  p->slice += now - c->runstart;
+  c->runstart = now;
+  if (p->slice >= quantum[p->prio]) {
+    if (p->prio < NPRIO - 1)
+      p->prio++;
+    p->slice = 0;
+  } else {
+    for (i = 0; i < p->prio && !c->runq[i]; i++)
+      ;
+    if (i == p->prio) {
+      timerarm(quantum[p->prio] - p->slice);
+      release(&ptable.lock);
+      return;
+    }
+  }
+  runqadd(p);
   sched();
   release(&ptable.lock);
 }
 
+// Returns every process to level 0, keeping the order of each run
+// queue by level.
+void priorityreset(void) {
+  struct proc *p;
+  struct cpu *c;
+  int i;
+
+  acquire(&ptable.lock);
+  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+    p->prio = 0;
+    p->slice = 0;
+  }
+  for (c = cpus; c < &cpus[ncpu]; c++) {
+    for (i = 1; i < NPRIO; i++) {
+      if (!c->runq[i])
+        continue;
+      if (c->runqtail[0])
+        c->runqtail[0]->rqnext = c->runq[i];
+      else
+        c->runq[0] = c->runq[i];
+      c->runqtail[0] = c->runqtail[i];
+      c->runq[i] = c->runqtail[i] = 0;
+    }
+  }
+  release(&ptable.lock);
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch here.  "Return" to user space.
 void forkret(void) {
@@ -346,30 +840,42 @@ void forkret(void) {
     first = 0;
     //log_recover();
     iinit(ROOTDEV);
+    swapinit(ROOTDEV);
+    pcacheinit();
     //log_recover();
   }
 
   // Return to "caller", actually trapret (see allocproc).
 }
 
+// A kernel thread's first scheduling by scheduler() swtches here.
+static void kthreadmain(void) {
+  struct proc *p = myproc();
+
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+  p->kfn(p->karg);
+  exit();
+}
+
 // allocates more memory on the heap
+// Grows the heap by n bytes. Only address space is reserved: each page
+// is zero-filled by the page fault handler when it is first touched.
 int sbrk(int n) {
-  // check if current "unused" space inside the user heap can already
-  // support the given number of bytes
-  struct vspace myvspace = myproc()->vspace;
-  uint64_t old_heap_bound = myvspace.regions[VR_HEAP].va_base + myvspace.regions[VR_HEAP].size;
-
-  int res = vregionaddmap(&myproc()->vspace.regions[VR_HEAP], 
-                          old_heap_bound,
-                          n,
-                          VPI_PRESENT,
-                          VPI_WRITABLE);
-  if (res < 0) { 
-    return  -1;
-  }
-
-  myproc()->vspace.regions[VR_HEAP].size += n;
-  vspaceinvalidate(&myproc()->vspace);
+  struct vspace *vs = myproc()->vspace;
+  struct vregion *heap = &vs->regions[VR_HEAP];
+  uint64_t old_heap_bound;
+
+  acquiresleep(&vs->lock);
+  old_heap_bound = heap->va_base + heap->size;
+  // Stay clear of the mappings and the largest stack growustack allows.
+  if (n < 0 || old_heap_bound + n >= vspaceheaplimit(vs)) {
+    releasesleep(&vs->lock);
+    return -1;
+  }
+
+  heap->size += n;
+  releasesleep(&vs->lock);
   return old_heap_bound;
 }
 
@@ -396,6 +902,10 @@ void sleep(void *chan, struct spinlock *lk) {
   // Go to sleep.
   myproc()->chan = chan;
   myproc()->state = SLEEPING;
+  myproc()->waitprev = waitq(chan);
+  if ((myproc()->waitnext = *myproc()->waitprev))
+    myproc()->waitnext->waitprev = &myproc()->waitnext;
+  *myproc()->waitprev = myproc();
   sched();
 
   // Tidy up.
@@ -411,11 +921,13 @@ void sleep(void *chan, struct spinlock *lk) {
 // Wake up all processes sleeping on chan.
 // The ptable lock must be held.
 static void wakeup1(void *chan) {
-  struct proc *p;
+  struct proc *p, *next;
 
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if (p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  for (p = *waitq(chan); p; p = next) {
+    next = p->waitnext;
+    if (p->chan == chan)
+      runqwake(p);
+  }
 }
 
 // Wake up all processes sleeping on chan.
@@ -437,7 +949,7 @@ int kill(int pid) {
       p->killed = 1;
       // Wake process from sleep if necessary.
       if (p->state == SLEEPING)
-        p->state = RUNNABLE;
+        runqwake(p);
       release(&ptable.lock);
       return 0;
     }
@@ -446,49 +958,6 @@ int kill(int pid) {
   return -1;
 }
 
-uint64_t updatevpages(uint64_t va, uint64_t ppn, short present, uint64_t spn, short swap) {
-  struct proc *p;
-
-  uint64_t prev_pn = 0;
-
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-    for (int i = VR_CODE; i < VR_USTACK; i++) {
-      struct vregion *vr = va2vregion(&p->vspace, va);  
-      if (!vr || !vregioncontains(vr, va, 1))
-        continue;
-      struct vpage_info *vpi = va2vpage_info(vr, va);
-
-      // moving this page back to p mem
-      if (present == VPI_PRESENT && vpi->spn == spn) {
-        prev_pn = vpi->spn;
-        vpi->ppn = ppn;
-        vpi->present = present;
-        vpi->spn = 0;
-        vpi->swap = 0;
-
-        is_vspaceinvalidating = 1;
-        vspaceinvalidate(&p->vspace);
-        is_vspaceinvalidating = 0;
-
-      // moving this to swap region
-      } else if (swap == VPI_SWAP && vpi->ppn == ppn) {
-        prev_pn = vpi->ppn;
-        vpi->spn = spn;
-        vpi->swap = swap;
-        vpi->ppn = 0;
-        vpi->present = 0;
-
-        is_vspaceinvalidating = 1;
-        vspaceinvalidate(&p->vspace);
-        is_vspaceinvalidating = 0;
-
-      }
-    }
-  }
-
-  return prev_pn;
-}
-
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
@@ -508,7 +977,11 @@ void procdump(void) {
       state = states[p->state];
     else
       state = "???";
-    cprintf("%d %s %s", p->pid, state, p->name);
+    cprintf("%d %s %s prio %d rss %d swap %d wss %d flt %d/%d cow %d huge %d",
+            p->pid, state, p->name, p->prio, p->vspace->stat.rss,
+            p->vspace->stat.swapped, p->vspace->stat.wss,
+            p->vspace->stat.majflt, p->vspace->stat.minflt,
+            p->vspace->stat.cowbreaks, p->vspace->stat.huge);
     if (p->state == SLEEPING) {
       getcallerpcs((uint64_t *)p->context->rbp, pc);
       for (i = 0; i < 10 && pc[i] != 0; i++)
@@ -518,6 +991,77 @@ void procdump(void) {
   }
 }
 
+// Copies the memory statistics of process pid into info.
+int procmeminfo(int pid, struct proc_info *info) {
+  struct proc *p;
+
+  acquire(&ptable.lock);
+  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+    if (p->pid == pid && p->state != UNUSED && p->state != ZOMBIE) {
+      info->rss = p->vspace->stat.rss;
+      info->swapped = p->vspace->stat.swapped;
+      info->wss = p->vspace->stat.wss;
+      info->major_faults = p->vspace->stat.majflt;
+      info->minor_faults = p->vspace->stat.minflt;
+      info->cow_breaks = p->vspace->stat.cowbreaks;
+      info->huge_pages = p->vspace->stat.huge;
+      info->priority = p->prio;
+      release(&ptable.lock);
+      return 0;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
+// Returns each process's fair share of user memory in pages: the
+// pages in use or free, split evenly among address spaces with
+// resident pages.
+int wsshare(void) {
+  int n = vspacesresident();
+
+  return (pages_in_use + free_pages) / max(n, 1);
+}
+
+// Sets the CPU the current process prefers to run on, or clears the
+// preference if cpu is -1. The process moves there the next time it
+// gives up the CPU. Returns 0, or -1 if there is no such CPU.
+int setaffinity(int cpu) {
+  if (cpu < -1 || cpu >= ncpu)
+    return -1;
+
+  acquire(&ptable.lock);
+  myproc()->affinity = cpu;
+  release(&ptable.lock);
+  return 0;
+}
+
+// Moves process pid to scheduling level prio, 0 being the highest,
+// with a fresh quantum. The scheduler moves it on from there as
+// usual. Returns 0, or -1 if there is no such process or level.
+int setpriority(int pid, int prio) {
+  struct proc *p;
+
+  if (prio < 0 || prio >= NPRIO)
+    return -1;
+
+  acquire(&ptable.lock);
+  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+    if (p->pid == pid && p->state != UNUSED && p->state != ZOMBIE) {
+      if (p->state == RUNNABLE)
+        runqremove(p);
+      p->prio = prio;
+      p->slice = 0;
+      if (p->state == RUNNABLE)
+        runqadd(p);
+      release(&ptable.lock);
+      return 0;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
 struct proc *findproc(int pid) {
   struct proc *p;
   for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
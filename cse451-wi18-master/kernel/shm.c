@@ -0,0 +1,133 @@
+// Shared memory segments.
+//
+// A segment is a named set of zeroed pages that any process can map
+// with shmat. Every mapping maps the same frames, so what one process
+// stores another sees without a copy through the kernel. Mappings are
+// shared regions of the vspace: fork shares them with the child, and
+// munmap, exit and exec drop them.
+//
+// The segment holds one reference to each of its pages, and each
+// mapping one more, all counted in the core map. shmunlink forgets the
+// name and drops the segment's references, so the pages go away with
+// the last mapping.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <proc.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+
+#define SHMNAME 16
+
+struct shmseg {
+  char name[SHMNAME]; // empty if the segment is free
+  int npages;
+  char *pages[SHMPAGES];
+};
+
+struct {
+  // Sleeps rather than spins: mapping a segment may allocate memory.
+  struct sleeplock lock;
+  struct shmseg segs[NSHM];
+} shm;
+
+void
+shminit(void)
+{
+  initsleeplock(&shm.lock, "shm");
+}
+
+// Drops the segment's references to its pages. Caller must hold
+// shm.lock.
+static void
+segfree(struct shmseg *s)
+{
+  int i;
+
+  for (i = 0; i < s->npages; i++)
+    kfree(s->pages[i]);
+  memset(s, 0, sizeof(*s));
+}
+
+// Returns the id of the segment called name, creating it with size
+// bytes of zeroed pages if there is none. Returns -1 if the name is
+// empty or too long, or if there is no room for the segment.
+int
+shmopen(char *name, int size)
+{
+  struct shmseg *s, *free = 0;
+  int n = PGROUNDUP(size) / PGSIZE;
+
+  if (name[0] == 0 || strlen(name) >= SHMNAME)
+    return -1;
+
+  acquiresleep(&shm.lock);
+  for (s = shm.segs; s < &shm.segs[NSHM]; s++) {
+    if (s->name[0] == 0) {
+      if (!free)
+        free = s;
+    } else if (strncmp(s->name, name, SHMNAME) == 0) {
+      releasesleep(&shm.lock);
+      return s - shm.segs;
+    }
+  }
+
+  if (!free || n <= 0 || n > SHMPAGES) {
+    releasesleep(&shm.lock);
+    return -1;
+  }
+  for (s = free; s->npages < n; s->npages++) {
+    if (!(s->pages[s->npages] = kalloc())) {
+      segfree(s);
+      releasesleep(&shm.lock);
+      return -1;
+    }
+    memset(s->pages[s->npages], 0, PGSIZE);
+  }
+  safestrcpy(s->name, name, SHMNAME);
+  releasesleep(&shm.lock);
+  return s - shm.segs;
+}
+
+// Maps segment id into the current process. Returns the address of
+// the mapping, or -1.
+int
+shmat(int id)
+{
+  struct shmseg *s;
+  int va;
+
+  if (id < 0 || id >= NSHM)
+    return -1;
+
+  acquiresleep(&shm.lock);
+  s = &shm.segs[id];
+  acquiresleep(&myproc()->vspace->lock);
+  va = s->name[0] ? vspacemapshared(myproc()->vspace, s->pages, s->npages)
+                  : -1;
+  releasesleep(&myproc()->vspace->lock);
+  releasesleep(&shm.lock);
+  return va;
+}
+
+// Removes the segment called name. Processes that map it keep their
+// mappings. Returns 0 on success, -1 if there is no such segment.
+int
+shmunlink(char *name)
+{
+  struct shmseg *s;
+
+  acquiresleep(&shm.lock);
+  for (s = shm.segs; s < &shm.segs[NSHM]; s++) {
+    if (s->name[0] && strncmp(s->name, name, SHMNAME) == 0) {
+      segfree(s);
+      releasesleep(&shm.lock);
+      return 0;
+    }
+  }
+  releasesleep(&shm.lock);
+  return -1;
+}
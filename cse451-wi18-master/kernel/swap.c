@@ -0,0 +1,352 @@
+// Swap space.
+//
+// Swap space is made of up to NSWAPAREA areas: the swap region mkfs
+// reserves on the root disk, as described by the superblock, and any
+// swap files added later by swapon. An area is a run of page-sized
+// slots backed by one or more ranges of contiguous disk blocks. A swap
+// page number (spn) names an area and a slot within it.
+//
+// Each area keeps a bitmap of the slots in use, searched next-fit from
+// a cursor one 64-bit word at a time, and a reference count per slot.
+// A run of slots handed out for a cluster never straddles two block
+// ranges, so the whole cluster moves with one disk request.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <file.h>
+#include <fs.h>
+#include <mmu.h>
+#include <param.h>
+#include <proc.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+
+#include <buf.h>
+
+#define NSWAPAREA 4
+#define AREASLOTS (PGSIZE * 8) // max slots per area: one bitmap page
+#define SLOTBLKS (PGSIZE / BSIZE)
+#define REFSPERPG (PGSIZE / sizeof(ushort)) // slot reference counts per page
+
+struct swaparea {
+  int used;
+  uint dev;
+  struct inode *ip;            // swap file, or 0 for the swap region
+  int nrange;
+  struct extent range[EXTENT_N]; // block ranges backing the slots
+  uint rangeslot[EXTENT_N];    // first slot of each range
+  uint nslots;
+  uint nfree;
+  uint cursor;                 // next-fit: slot after the last run
+  uint64_t *bitmap;            // bit set if the slot is in use
+  ushort *refs[AREASLOTS / REFSPERPG]; // references to each slot
+};
+
+struct {
+  struct spinlock lock; // protects areas
+  struct buf io;        // bulk request for all swap transfers
+  struct swaparea areas[NSWAPAREA];
+} swap;
+
+static struct swaparea *
+spnarea(uint64_t spn)
+{
+  struct swaparea *sa;
+
+  if (spn / AREASLOTS >= NSWAPAREA)
+    return 0;
+  sa = &swap.areas[spn / AREASLOTS];
+  if (!sa->used || spn % AREASLOTS >= sa->nslots)
+    return 0;
+  return sa;
+}
+
+static inline int
+slotused(struct swaparea *sa, uint slot)
+{
+  return (sa->bitmap[slot / 64] >> (slot % 64)) & 1;
+}
+
+static inline ushort *
+slotref(struct swaparea *sa, uint slot)
+{
+  return &sa->refs[slot / REFSPERPG][slot % REFSPERPG];
+}
+
+// Returns the range holding slot.
+static int
+slotrange(struct swaparea *sa, uint slot)
+{
+  int r;
+
+  for (r = sa->nrange - 1; r > 0 && slot < sa->rangeslot[r]; r--)
+    ;
+  return r;
+}
+
+// Adds an area backed by the given block ranges of dev, using at most
+// maxslots slots. Returns 0 on success, -1 on failure.
+static int
+addarea(uint dev, struct inode *ip, struct extent *ext, int next, uint maxslots)
+{
+  struct swaparea a, *sa;
+  uint n;
+  int i;
+
+  memset(&a, 0, sizeof(a));
+  a.dev = dev;
+  a.ip = ip;
+  maxslots = min(maxslots, (uint)AREASLOTS);
+  for (i = 0; i < next && a.nslots < maxslots; i++) {
+    if ((n = min(ext[i].nblocks / SLOTBLKS, maxslots - a.nslots)) == 0)
+      continue;
+    a.range[a.nrange].startblkno = ext[i].startblkno;
+    a.range[a.nrange].nblocks = n * SLOTBLKS;
+    a.rangeslot[a.nrange++] = a.nslots;
+    a.nslots += n;
+  }
+  a.nfree = a.nslots;
+  if (a.nslots == 0 || !(a.bitmap = (uint64_t *)kalloc()))
+    return -1;
+  memset(a.bitmap, 0, PGSIZE);
+  for (i = 0; i * REFSPERPG < a.nslots; i++) {
+    if (!(a.refs[i] = (ushort *)kalloc()))
+      goto bad;
+    memset(a.refs[i], 0, PGSIZE);
+  }
+
+  acquire(&swap.lock);
+  for (sa = swap.areas; sa < &swap.areas[NSWAPAREA]; sa++) {
+    if (!sa->used) {
+      *sa = a;
+      sa->used = 1;
+      release(&swap.lock);
+      cprintf("swap: %d slots on dev %d%s\n", a.nslots, dev, ip ? " (file)" : "");
+      return 0;
+    }
+  }
+  release(&swap.lock);
+
+bad:
+  kfree((char *)a.bitmap);
+  for (i = 0; i < NELEM(a.refs); i++)
+    if (a.refs[i])
+      kfree((char *)a.refs[i]);
+  return -1;
+}
+
+// Sets up swap on the swap region of dev described by its superblock.
+void
+swapinit(int dev)
+{
+  struct superblock sb;
+  struct extent ext;
+
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.io.lock, "swap io");
+
+  readsb(dev, &sb);
+  ext.startblkno = sb.swapstart;
+  ext.nblocks = sb.nswap;
+  if (addarea(dev, 0, &ext, 1, sb.nswap / SLOTBLKS) < 0)
+    cprintf("swap: no swap region\n");
+  zswapinit();
+}
+
+// Adds the blocks of file ip as a swap area. Slots cover the whole
+// pages of the file's extents up to its size. The swap area holds on
+// to ip. Its contents are written behind the buffer cache's back, so
+// the caller must keep anything else from writing the file.
+int
+swapon(struct inode *ip)
+{
+  struct swaparea *sa;
+
+  acquire(&swap.lock);
+  for (sa = swap.areas; sa < &swap.areas[NSWAPAREA]; sa++) {
+    if (sa->used && sa->ip == ip) {
+      release(&swap.lock);
+      return -1;
+    }
+  }
+  release(&swap.lock);
+
+  return addarea(ip->dev, ip, ip->data, EXTENT_N, ip->size / PGSIZE);
+}
+
+// Finds n free slots in [lo, hi) of sa that lie in one block range.
+// Returns the first, or -1.
+static int
+findrun(struct swaparea *sa, uint lo, uint hi, int n)
+{
+  uint i, start = lo;
+  int r, run = 0;
+
+  for (i = lo; i < hi; i++) {
+    // Skip a word of slots that are all in use.
+    if (i % 64 == 0 && i + 64 <= hi && sa->bitmap[i / 64] == ~0ULL) {
+      run = 0;
+      i += 63;
+      continue;
+    }
+    if (slotused(sa, i)) {
+      run = 0;
+      continue;
+    }
+    for (r = 1; run > 0 && r < sa->nrange; r++)
+      if (i == sa->rangeslot[r])
+        run = 0;
+    if (run++ == 0)
+      start = i;
+    if (run == n)
+      return start;
+  }
+  return -1;
+}
+
+// Tests whether n slots from spn are free and in one block range.
+static int
+runfree(uint64_t spn, int n)
+{
+  struct swaparea *sa;
+  uint slot = spn % AREASLOTS;
+  int i;
+
+  if (!(sa = spnarea(spn)) || slot + n > sa->nslots)
+    return 0;
+  if (slotrange(sa, slot) != slotrange(sa, slot + n - 1))
+    return 0;
+  for (i = 0; i < n; i++)
+    if (slotused(sa, slot + i))
+      return 0;
+  return 1;
+}
+
+// Allocates a run of *n slots that are contiguous on disk, shrinking
+// *n if no run that long is free. The run starts at hint if those slots
+// are free, so that a cluster can continue the one written before it;
+// otherwise each area is searched next-fit from its cursor. Each slot
+// starts with one reference. Returns the first slot, or -1 if swap is
+// full.
+int
+swapalloc(int *n, uint64_t hint)
+{
+  struct swaparea *sa;
+  uint64_t spn;
+  int first, i;
+
+  acquire(&swap.lock);
+  if (runfree(hint, *n)) {
+    spn = hint;
+    sa = spnarea(spn);
+    goto found;
+  }
+  for (; *n > 0; (*n)--) {
+    for (sa = swap.areas; sa < &swap.areas[NSWAPAREA]; sa++) {
+      if (!sa->used || sa->nfree < *n)
+        continue;
+      if ((first = findrun(sa, sa->cursor, sa->nslots, *n)) < 0 &&
+          (first = findrun(sa, 0, sa->cursor, *n)) < 0)
+        continue;
+      spn = (sa - swap.areas) * AREASLOTS + first;
+      goto found;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+
+found:
+  for (i = 0; i < *n; i++) {
+    sa->bitmap[(spn + i) % AREASLOTS / 64] |= 1ULL << ((spn + i) % 64);
+    *slotref(sa, (spn + i) % AREASLOTS) = 1;
+  }
+  sa->nfree -= *n;
+  sa->cursor = (spn % AREASLOTS + *n) % sa->nslots;
+  pages_in_swap += *n;
+  release(&swap.lock);
+  return spn;
+}
+
+// Adds a reference to slot spn, for a vpage_info copied by fork.
+void
+swapdup(uint64_t spn)
+{
+  struct swaparea *sa;
+  ushort *ref;
+
+  acquire(&swap.lock);
+  if (!(sa = spnarea(spn)) || *(ref = slotref(sa, spn % AREASLOTS)) == 0)
+    panic("swapdup: bad slot");
+  if (*ref == (ushort)-1)
+    panic("swapdup: too many references");
+  (*ref)++;
+  release(&swap.lock);
+}
+
+// Drops a reference to slot spn, freeing the slot with the last one.
+void
+swapfree(uint64_t spn)
+{
+  struct swaparea *sa;
+  uint slot = spn % AREASLOTS;
+
+  acquire(&swap.lock);
+  if (!(sa = spnarea(spn)) || *slotref(sa, slot) == 0)
+    panic("swapfree: bad slot");
+  if (--(*slotref(sa, slot)) == 0) {
+    sa->bitmap[slot / 64] &= ~(1ULL << (slot % 64));
+    sa->nfree++;
+    pages_in_swap--;
+    zswapinvalidate(spn);
+  }
+  release(&swap.lock);
+}
+
+// Returns the number of references to slot spn, 0 if it is not in use.
+int
+swapref(uint64_t spn)
+{
+  struct swaparea *sa;
+  int ref;
+
+  acquire(&swap.lock);
+  ref = (sa = spnarea(spn)) ? *slotref(sa, spn % AREASLOTS) : 0;
+  release(&swap.lock);
+  return ref;
+}
+
+// Tests whether slots a and a + 1 are next to each other on disk.
+int
+swapadjacent(uint64_t a)
+{
+  struct swaparea *sa;
+
+  if (!(sa = spnarea(a)) || a % AREASLOTS + 1 >= sa->nslots)
+    return 0;
+  return slotrange(sa, a % AREASLOTS) == slotrange(sa, (a + 1) % AREASLOTS);
+}
+
+// Moves n pages between memory and the n slots starting at spn, which
+// must be contiguous on disk, with a single disk request.
+void
+swapio(uint64_t spn, char **pages, int n, int write)
+{
+  struct swaparea *sa = spnarea(spn);
+  struct buf *b = &swap.io;
+  uint slot = spn % AREASLOTS;
+  int r = slotrange(sa, slot);
+
+  acquiresleep(&b->lock);
+  b->dev = sa->dev;
+  b->blockno = sa->range[r].startblkno + (slot - sa->rangeslot[r]) * SLOTBLKS;
+  b->pages = pages;
+  b->nsect = n * SLOTBLKS;
+  b->flags = write ? B_DIRTY : 0;
+  iderw(b);
+  b->pages = 0;
+  releasesleep(&b->lock);
+
+  // Counted per block, as bread counts them.
+  if (!write)
+    num_disk_reads += n * SLOTBLKS;
+}
@@ -16,15 +16,62 @@
 // library system call function. The saved user %esp points
 // to a saved program counter, and then the first argument.
 
+// Faults in the pages of [va, va+size) in the current process, for
+// writing if write is set and the mapping allows it, so that the kernel
+// can use them while holding spinlocks without taking a page fault.
+// The vspace is pinned against the swapper until the system call
+// returns (see faultindone).
+static void
+faultin(uint64_t va, uint64_t size, int write)
+{
+  struct proc *p = myproc();
+  struct vspace *vs = p->vspace;
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t a;
+
+  acquiresleep(&vs->lock);
+  if (!p->pinned) {
+    vs->kpins++;
+    p->pinned = vs;
+  }
+  for (a = PGROUNDDOWN(va); a < va + size; a += PGSIZE) {
+    if (!(vr = va2vregion(vs, a)))
+      continue;
+    vpi = va2vpage_info(vr, a);
+    if (vpi && vpi->used && vpi->present &&
+        (vpi->writable || !write || vr->readonly))
+      continue;
+    pagefault(vs, a, write && !vr->readonly ? FEC_WR : 0);
+  }
+  releasesleep(&vs->lock);
+}
+
+// Unpins the vspace the current system call faulted pages in, if any.
+void
+faultindone(void)
+{
+  struct proc *p = myproc();
+  struct vspace *vs;
+
+  if (!(vs = p->pinned))
+    return;
+  acquiresleep(&vs->lock);
+  vs->kpins--;
+  releasesleep(&vs->lock);
+  p->pinned = 0;
+}
+
 #define syscall_gen_fetcher(type) \
   int \
   fetch ## type(uint64_t addr, type *ip) \
   { \
     struct vregion *r; \
     struct vspace *v; \
-    v = &myproc()->vspace; \
-    for (r = v->regions; r < &v->regions[NREGIONS]; r++) { \
+    v = myproc()->vspace; \
+    for_each_vregion(r, v) { \
       if (vregioncontains(r, addr, sizeof(type))) { \
+        faultin(addr, sizeof(type), 0); \
         *ip = *(type *)(addr); \
         return 0; \
       } \
@@ -51,12 +98,14 @@ fetchstr(uint64_t addr, char **pp)
   struct vspace *v;
   char *s, *ep;
 
-  v = &myproc()->vspace;
-  for (r = v->regions; r < &v->regions[NREGIONS]; r++) {
+  v = myproc()->vspace;
+  for_each_vregion(r, v) {
     if (vregioncontains(r, addr, 0)) {
       *pp = (char*)addr;
       ep = (char *)VRTOP(r);
       for(s = *pp; s < ep; s++) {
+        if(s == *pp || (uint64_t)s % PGSIZE == 0)
+          faultin((uint64_t)s, 1, 0);
         if(*s == 0)
           return s - *pp;
       }
@@ -108,9 +157,11 @@ int argptr(int n, char **pp, int size) {
   if (size < 0)
     return -1;
 
-  v = &myproc()->vspace;
-  for (r = v->regions; r < &v->regions[NREGIONS]; r++) {
+  v = myproc()->vspace;
+  for_each_vregion(r, v) {
     if (vregioncontains(r, i, size)) {
+      // The kernel may write the buffer, as read() does.
+      faultin(i, size, 1);
       *pp = (char*)i;
       return 0;
     }
@@ -120,8 +171,8 @@ int argptr(int n, char **pp, int size) {
 
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
-// (There is no shared writable memory, so the string can't change
-// between this check and being used by the kernel.)
+// (Shared mappings aside, there is no shared writable memory, so the
+// string can't change between this check and being used by the kernel.)
 int argstr(int n, char **pp) {
   int addr;
   if (argint(n, &addr) < 0)
@@ -133,7 +184,7 @@ int argfd(int n, int *fd) {
   argint(n, fd);
 
   struct proc *p = myproc();
-  if (p->file_table[*fd] == NULL)
+  if (p->fdtable->fd[*fd] == NULL)
     return -1;
 
   return 0;
@@ -157,6 +208,22 @@ extern int sys_write(void);
 extern int sys_uptime(void);
 extern int sys_sysinfo(void);
 extern int sys_crashn(void);
+extern int sys_swapon(void);
+extern int sys_procinfo(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_msync(void);
+extern int sys_shmopen(void);
+extern int sys_shmat(void);
+extern int sys_shmunlink(void);
+extern int sys_setaffinity(void);
+extern int sys_setpriority(void);
+extern int sys_nanosleep(void);
+extern int sys_clone(void);
+extern int sys_thread_join(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_spawn(void);
 
 static int (*syscalls[])(void) = {
     [SYS_fork] = sys_fork,       [SYS_exit] = sys_exit,
@@ -168,6 +235,14 @@ static int (*syscalls[])(void) = {
     [SYS_uptime] = sys_uptime,   [SYS_open] = sys_open,
     [SYS_write] = sys_write,     [SYS_close] = sys_close,
     [SYS_sysinfo] = sys_sysinfo, [SYS_crashn] = sys_crashn,
+    [SYS_swapon] = sys_swapon,   [SYS_procinfo] = sys_procinfo,
+    [SYS_mmap] = sys_mmap,       [SYS_munmap] = sys_munmap,
+    [SYS_msync] = sys_msync,     [SYS_shmopen] = sys_shmopen,
+    [SYS_shmat] = sys_shmat,     [SYS_shmunlink] = sys_shmunlink,
+    [SYS_setaffinity] = sys_setaffinity, [SYS_setpriority] = sys_setpriority,
+    [SYS_nanosleep] = sys_nanosleep, [SYS_clone] = sys_clone,
+    [SYS_thread_join] = sys_thread_join, [SYS_futex_wait] = sys_futex_wait,
+    [SYS_futex_wake] = sys_futex_wake, [SYS_spawn] = sys_spawn,
 };
 
 void syscall(void) {
@@ -176,6 +251,7 @@ void syscall(void) {
   num = myproc()->tf->rax;
   if (num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     myproc()->tf->rax = syscalls[num]();
+    faultindone();
   } else {
     cprintf("%d %s: unknown sys call %d\n", myproc()->pid, myproc()->name, num);
     myproc()->tf->rax = -1;
@@ -193,6 +269,18 @@ int sys_sysinfo(void) {
   info->free_pages = free_pages;
   info->num_page_faults = num_page_faults;
   info->num_disk_reads = num_disk_reads;
+  zswapstat(info);
+  pcachestat(info);
 
   return 0;
 }
+
+int sys_procinfo(void) {
+  int pid;
+  struct proc_info *info;
+
+  if (argint(0, &pid) < 0 || argptr(1, (void *)&info, sizeof(*info)) < 0)
+    return -1;
+
+  return procmeminfo(pid, info);
+}
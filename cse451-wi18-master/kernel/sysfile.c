@@ -9,9 +9,11 @@
 #include <fcntl.h>
 #include <file.h>
 #include <fs.h>
+#include <mman.h>
 #include <mmu.h>
 #include <param.h>
 #include <proc.h>
+#include <spawn.h>
 #include <sleeplock.h>
 #include <spinlock.h>
 #include <stat.h>
@@ -32,7 +34,7 @@ int sys_dup(void) {
   // check whether the valid bit for the given fd is set to
   // 1 in the global file table
   struct proc *p = myproc();
-  struct file f = *(p->file_table[fd]);
+  struct file f = *(p->fdtable->fd[fd]);
 
   acquire(&ftable.lock);
   if (ftable.valid_flags[f.global_fd] == 0) {
@@ -59,7 +61,7 @@ int sys_read(void) {
   // check whether the valid bit for the given fd is set to 1 in
   // the global file table, and that its access permissions includes
   // read permission
-  struct file f = *(myproc()->file_table[fd]);
+  struct file f = *(myproc()->fdtable->fd[fd]);
   
   acquire(&ftable.lock);
   if (ftable.valid_flags[f.global_fd] == 0 || f.permissions == O_WRONLY) {
@@ -96,9 +98,9 @@ int sys_write(void) {
   // check whether the valid bit for the given fd is set to 1 in
   // the global file table, and that its access permissions includes
   // write permission
-  //struct file f = *(myproc()->file_table[fd]);
+  //struct file f = *(myproc()->fdtable->fd[fd]);
 
-  struct file *f = myproc()->file_table[fd];
+  struct file *f = myproc()->fdtable->fd[fd];
 
   acquire(&ftable.lock);
   if (ftable.valid_flags[f->global_fd] == 0 || f->permissions == O_RDONLY) {
@@ -134,7 +136,7 @@ int sys_close(void) {
   // chcek whether the valid bit for the given fd is set to 1
   // in the global file table
   struct proc *p = myproc();
-  struct file f = *(p->file_table[fd]);
+  struct file f = *(p->fdtable->fd[fd]);
 
   acquire(&ftable.lock);
   if (ftable.valid_flags[f.global_fd] == 0) {
@@ -159,7 +161,7 @@ int sys_fstat(void) {
 
   // check whether the valid bit for the given fd is set to 1 in
   // the global file table 
-  struct file f = *(myproc()->file_table[fd]);
+  struct file f = *(myproc()->fdtable->fd[fd]);
 
   acquire(&ftable.lock);
   if (ftable.valid_flags[f.global_fd] == 0) {
@@ -212,23 +214,10 @@ int sys_open(void) {
   return res;
 }
 
-int sys_exec(void) {
-  char * filepath; 		// arg0: path to the exe file
-  char * arguments[MAXARG]; 	// arg1: array of strings for arguments
-
-  // check if arg0 points to an invalid or unmapped address
-  // or if there is an invalid address before the end of the string
-  if (argstr(0, &filepath) < 0 || argptr(0, &filepath, strlen(filepath)) < 0)
-    return -1;
-
-  int addr;
-  // check if the arg1 points to an invalid or unmapped address
-  if (argint(1, &addr) < 0) {
-    return -1;
-  }
-
+// Fetches the null-terminated array of strings at addr into
+// arguments. Returns the number of strings, or -1.
+static int fetchargv(int addr, char **arguments) {
   // loop through the arguments until a null argument is reached
-  // and then call execute.
   for (int i = 0; i < MAXARG; i++) { 
 
     // fetch address of the ith argument
@@ -242,8 +231,8 @@ int sys_exec(void) {
       return -1;
     }
 
-    if (arguments[i] == '\0') {
-      return exec(i, filepath, arguments);
+    if (arguments[i] == 0) {
+      return i;
     }
   }
 
@@ -251,6 +240,39 @@ int sys_exec(void) {
   return -1;
 }
 
+int sys_exec(void) {
+  char * filepath; 		// arg0: path to the exe file
+  char * arguments[MAXARG]; 	// arg1: array of strings for arguments
+  int addr, n;
+
+  // check if arg0 points to an invalid or unmapped address
+  // or if there is an invalid address before the end of the string
+  if (argstr(0, &filepath) < 0 || argptr(0, &filepath, strlen(filepath)) < 0)
+    return -1;
+
+  // check if the arg1 points to an invalid or unmapped address
+  if (argint(1, &addr) < 0 || (n = fetchargv(addr, arguments)) < 0) {
+    return -1;
+  }
+  return exec(n, filepath, arguments);
+}
+
+int sys_spawn(void) {
+  char *filepath;		// arg0: path to the exe file
+  char *arguments[MAXARG];	// arg1: array of strings for arguments
+  struct spawn_action *fa;	// arg2: file actions for the child
+  int nfa;			// arg3: number of file actions
+  int addr, n;
+
+  if (argstr(0, &filepath) < 0 || argint(1, &addr) < 0 ||
+      (n = fetchargv(addr, arguments)) < 0 || argint(3, &nfa) < 0 ||
+      nfa < 0 || nfa > MAXARG)
+    return -1;
+  if (nfa > 0 && argptr(2, (char **)&fa, nfa * sizeof(*fa)) < 0)
+    return -1;
+  return spawn(filepath, n, arguments, fa, nfa);
+}
+
 int sys_pipe(void) {
   int * fds; 		// arg0: pointer to an array of two fds
 
@@ -265,3 +287,71 @@ int sys_pipe(void) {
 
   return res;
 }
+
+int sys_swapon(void) {
+  char *filepath;	// arg0: path to the swap file
+  struct inode *ip;
+
+  if (argstr(0, &filepath) < 0 || (ip = namei(filepath)) == NULL)
+    return -1;
+
+  // The swap area keeps the reference to the file. Nobody else may
+  // have it open or mapped, and writes to it fail from now on; the
+  // inode lock waits out a write in progress.
+  acquiresleep(&ip->lock);
+  if (ip->type != T_FILE || ip->ref != 1 || ip->swap || swapon(ip) < 0) {
+    releasesleep(&ip->lock);
+    irelease(ip);
+    return -1;
+  }
+  ip->swap = 1;
+  releasesleep(&ip->lock);
+  return 0;
+}
+
+int sys_mmap(void) {
+  int length;		// arg1: bytes to map
+  int prot;		// arg2: PROT_READ, optionally with PROT_WRITE
+  int flags;		// arg3: MAP_SHARED or MAP_PRIVATE, and MAP_ANONYMOUS
+  int fd;		// arg4: file to map, unless anonymous
+  int offset;		// arg5: page-aligned offset in the file
+  struct file *f;
+  struct inode *ip = 0;
+  struct vspace *vs = myproc()->vspace;
+  int va;
+
+  // arg0, the address hint, is ignored: the kernel places mappings.
+  if (argint(1, &length) < 0 || argint(2, &prot) < 0 ||
+      argint(3, &flags) < 0 || argint(5, &offset) < 0)
+    return -1;
+  if (length <= 0 || offset < 0 ||
+      !(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+    return -1;
+
+  if (!(flags & MAP_ANONYMOUS)) {
+    if (argfd(4, &fd) < 0)
+      return -1;
+    f = myproc()->fdtable->fd[fd];
+
+    // The file must be open for read, and for write as well if writes
+    // through the mapping are to reach it.
+    acquire(&ftable.lock);
+    if (ftable.valid_flags[f->global_fd] == 0 || f->file_type != ON_DISK ||
+        f->permissions == O_WRONLY ||
+        ((flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+         f->permissions == O_RDONLY)) {
+      release(&ftable.lock);
+      return -1;
+    }
+    release(&ftable.lock);
+
+    ip = f->inode;
+    if (ip->type != T_FILE)
+      return -1;
+  }
+
+  acquiresleep(&vs->lock);
+  va = vspacemmap(vs, length, prot, flags, ip, offset);
+  releasesleep(&vs->lock);
+  return va;
+}
@@ -55,31 +55,144 @@ int sys_sbrk(void) {
   return res;
 }
 
-int sys_sleep(void) {
+int sys_munmap(void) {
+  struct vspace *vs = myproc()->vspace;
+  int64_t addr;
+  int n, r;
+
+  if (argint64(0, &addr) < 0 || argint(1, &n) < 0 || n <= 0)
+    return -1;
+
+  acquiresleep(&vs->lock);
+  r = vspacemunmap(vs, addr, n);
+  releasesleep(&vs->lock);
+  // Other threads may still have the pages in their TLBs.
+  if (r == 0 && vs->ref > 1)
+    tlbshootdown();
+  return r;
+}
+
+int sys_msync(void) {
+  struct vspace *vs = myproc()->vspace;
+  int64_t addr;
   int n;
-  uint ticks0;
 
-  if (argint(0, &n) < 0)
+  if (argint64(0, &addr) < 0 || argint(1, &n) < 0 || n < 0 ||
+      addr % PGSIZE)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while (ticks - ticks0 < n) {
-    if (myproc()->killed) {
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
+
+  acquiresleep(&vs->lock);
+  vspacemsync(vs, addr, n);
+  releasesleep(&vs->lock);
   return 0;
 }
 
+int sys_shmopen(void) {
+  char *name;
+  int size;
+
+  if (argstr(0, &name) < 0 || argint(1, &size) < 0)
+    return -1;
+
+  return shmopen(name, size);
+}
+
+// A segment is detached with munmap.
+int sys_shmat(void) {
+  int id;
+
+  if (argint(0, &id) < 0)
+    return -1;
+
+  return shmat(id);
+}
+
+int sys_shmunlink(void) {
+  char *name;
+
+  if (argstr(0, &name) < 0)
+    return -1;
+
+  return shmunlink(name);
+}
+
+int sys_setaffinity(void) {
+  int cpu;
+
+  if (argint(0, &cpu) < 0)
+    return -1;
+  return setaffinity(cpu);
+}
+
+int sys_setpriority(void) {
+  int pid, prio;
+
+  if (argint(0, &pid) < 0 || argint(1, &prio) < 0)
+    return -1;
+  return setpriority(pid, prio);
+}
+
+int sys_clone(void) {
+  int64_t entry, a0, a1;
+
+  if (argint64(0, &entry) < 0 || argint64(1, &a0) < 0 ||
+      argint64(2, &a1) < 0)
+    return -1;
+  return clone(entry, a0, a1);
+}
+
+int sys_thread_join(void) {
+  int tid;
+
+  if (argint(0, &tid) < 0)
+    return -1;
+  return thread_join(tid);
+}
+
+int sys_futex_wait(void) {
+  int64_t addr;
+  int val, timeout;
+
+  if (argint64(0, &addr) < 0 || argint(1, &val) < 0 ||
+      argint(2, &timeout) < 0 || timeout < 0)
+    return -1;
+  return futex_wait(addr, val, timeout);
+}
+
+int sys_futex_wake(void) {
+  int64_t addr;
+  int n;
+
+  if (argint64(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futex_wake(addr, n);
+}
+
+int sys_sleep(void) {
+  int n;
+
+  if (argint(0, &n) < 0 || n < 0)
+    return -1;
+  return msleep(min(n, 0x7fffffff / MSPERTICK) * MSPERTICK);
+}
+
+// Sleeps for at least the given nanoseconds, rounded up to whole
+// milliseconds.
+int sys_nanosleep(void) {
+  int64_t ns;
+
+  if (argint64(0, &ns) < 0 || ns < 0)
+    return -1;
+  return msleep(min((ns + 999999) / 1000000, (int64_t)0x7fffffff));
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 int sys_uptime(void) {
   uint xticks;
 
   acquire(&tickslock);
+  clockupdate();
   xticks = ticks;
   release(&tickslock);
   return xticks;
@@ -0,0 +1,174 @@
+// Timers.
+//
+// Pending timers wait in a hierarchical timing wheel, keyed by the
+// millisecond at which each expires. The first level has a slot for
+// each of the next 256 milliseconds, and the second a slot for each of
+// the next 64 spans of 256 milliseconds. For each millisecond the clock
+// advances it looks at one slot of the first level; every 256 it moves
+// the timers of one slot of the second level down to the first. So
+// advancing costs nothing for timers that are not due, however many
+// processes are asleep. A timer further out than the second level
+// reaches waits in the slot that comes round last, and is put back
+// into the wheel each time it does.
+//
+// The clock is brought up to the time the TSC tells on each timer
+// interrupt, and before it is read. There is no periodic interrupt:
+// timerarm sets each CPU's timer for the next timer in the wheel or
+// the end of the running process's quantum, so an idle machine takes
+// interrupts only when something is due.
+//
+// A timer that fires wakes the processes sleeping on it. tickslock
+// guards the wheel and the clock.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <param.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <timer.h>
+
+#define WHEEL0BITS 8
+#define WHEEL1BITS 6
+#define WHEEL0 (1 << WHEEL0BITS) // slots of the first level
+#define WHEEL1 (1 << WHEEL1BITS) // slots of the second level
+
+uint msticks; // milliseconds since boot, as of the last clockupdate
+
+static struct timer *wheel0[WHEEL0];
+static struct timer *wheel1[WHEEL1];
+
+static void link(struct timer **slot, struct timer *t) {
+  t->prev = slot;
+  if ((t->next = *slot))
+    t->next->prev = &t->next;
+  *slot = t;
+}
+
+static void unlink(struct timer *t) {
+  if ((*t->prev = t->next))
+    t->next->prev = t->prev;
+  t->prev = 0;
+}
+
+// Puts t in the slot for its expiry, which must not have passed.
+static void insert(struct timer *t) {
+  uint span;
+
+  if (t->expires - msticks < WHEEL0) {
+    link(&wheel0[t->expires % WHEEL0], t);
+    return;
+  }
+  span = (t->expires >> WHEEL0BITS) - (msticks >> WHEEL0BITS);
+  link(&wheel1[((msticks >> WHEEL0BITS) + min(span, (uint)WHEEL1)) % WHEEL1], t);
+}
+
+// Arms t to fire at millisecond expires, or at the next one if that
+// has passed. Caller must hold tickslock.
+void timeradd(struct timer *t, uint expires) {
+  if ((int)(expires - msticks) <= 0)
+    expires = msticks + 1;
+  t->expires = expires;
+  insert(t);
+}
+
+// Disarms t if it has not fired. Caller must hold tickslock.
+void timerdel(struct timer *t) {
+  if (t->prev)
+    unlink(t);
+}
+
+// Advances the clock by a millisecond and fires the timers that
+// expire. Caller must hold tickslock.
+static void timertick(void) {
+  struct timer *t, *next;
+  uint i;
+
+  msticks++;
+  if (msticks % WHEEL0 == 0) {
+    i = (msticks >> WHEEL0BITS) % WHEEL1;
+    t = wheel1[i];
+    wheel1[i] = 0;
+    for (; t; t = next) {
+      next = t->next;
+      insert(t);
+    }
+  }
+
+  for (t = wheel0[msticks % WHEEL0]; t; t = next) {
+    next = t->next;
+    unlink(t);
+    wakeup(t);
+  }
+}
+
+// Brings the clock up to the present, firing the timers that expire
+// on the way. Caller must hold tickslock.
+void clockupdate(void) {
+  uint now = lapicms();
+
+  while ((int)(now - msticks) > 0) {
+    timertick();
+    if (msticks % MSPERTICK == 0) {
+      ticks++;
+      if (ticks % BOOSTTICKS == 0)
+        priorityreset();
+    }
+  }
+}
+
+// Returns the millisecond at which the wheel next needs the clock to
+// advance, for a timer that expires or moves down a level, or limit
+// if that is sooner. Reads the wheel without tickslock: a stale answer
+// costs at most an early interrupt, or misses a timer that another CPU
+// is adding, which that CPU arms its own timer for before it sleeps.
+static uint timernext(uint limit) {
+  uint t, span;
+
+  for (t = msticks + 1; t - msticks < WHEEL0; t++) {
+    if ((int)(t - limit) >= 0)
+      return limit;
+    if (wheel0[t % WHEEL0])
+      return t;
+  }
+  for (span = (msticks >> WHEEL0BITS) + 1;
+       span - (msticks >> WHEEL0BITS) <= WHEEL1; span++) {
+    t = span << WHEEL0BITS;
+    if ((int)(t - limit) >= 0)
+      return limit;
+    if (wheel1[span % WHEEL1])
+      return t;
+  }
+  return limit;
+}
+
+// Sets this CPU's timer to interrupt when the next timer is due, or
+// in ms milliseconds if that is sooner.
+void timerarm(uint ms) {
+  uint now = lapicms();
+  int d = timernext(now + ms) - now;
+
+  lapicarm(max(d, 1));
+}
+
+// Sleeps for ms milliseconds of the clock. Returns 0, or -1 if the
+// process is killed meanwhile.
+int msleep(uint ms) {
+  struct timer t;
+
+  if (ms == 0)
+    return 0;
+
+  acquire(&tickslock);
+  clockupdate();
+  timeradd(&t, msticks + ms);
+  while (t.prev) {
+    if (myproc()->killed) {
+      timerdel(&t);
+      release(&tickslock);
+      return -1;
+    }
+    sleep(&t, &tickslock);
+  }
+  release(&tickslock);
+  return 0;
+}
@@ -29,19 +29,18 @@ void tvinit(void) {
 
 void idtinit(void) { lidt((void *)idt, sizeof(idt)); }
 
-int growustack(void) {
-  struct vspace myvspace = myproc()->vspace;
+static int growustack(struct vspace *myvspace) {
   
   // If the stack is currently larger than or equal to 
   // ten pages, return error.
-  if (myvspace.regions[VR_USTACK].size >= 10 * PGSIZE) {
+  if (myvspace->regions[VR_USTACK].size >= 10 * PGSIZE) {
     return -1;
   }
 
-  int old_stack_bound = myvspace.regions[VR_USTACK].va_base 
-                        - myvspace.regions[VR_USTACK].size - PGSIZE;
+  int old_stack_bound = myvspace->regions[VR_USTACK].va_base 
+                        - myvspace->regions[VR_USTACK].size - PGSIZE;
   // Try adding a new page to the user stack.
-  int res = vregionaddmap(&myproc()->vspace.regions[VR_USTACK],
+  int res = vregionaddmap(&myvspace->regions[VR_USTACK],
                 old_stack_bound,
                 PGSIZE,
                 VPI_PRESENT,
@@ -49,16 +48,144 @@ int growustack(void) {
   if (res < 0) {
     return -1;
   }
-  myproc()->vspace.regions[VR_USTACK].size += PGSIZE;
+  myvspace->regions[VR_USTACK].size += PGSIZE;
 
-  vspaceinvalidate(&myproc()->vspace);
+  vspaceupdate(myvspace, old_stack_bound);
 
   return old_stack_bound;
 }
 
 
+// Makes the copy-on-write page vpi at addr in vs writable. Another
+// sharer may be breaking its own copy meanwhile, so whether the frame
+// is still shared is decided under its lock: the last reference takes
+// the frame over, any other gets a copy and drops its reference with
+// kfree. Returns 0, or -1 if out of memory.
+static int cowbreak(struct vspace *vs, uint64_t addr, struct vpage_info *vpi) {
+  struct core_map_entry *cme = pa2page(vpi->ppn << PT_SHIFT);
+  char *old = P2V(vpi->ppn << PT_SHIFT);
+  char *mem = 0;
+  int pinned;
+
+  for (;;) {
+    acquire(&cme->lock);
+    if (cme->ref_count == 1) {
+      // Last reference to this page. Set back to writable.
+      vpi->writable = VPI_WRITABLE;
+      vpi->cow = 0;
+      release(&cme->lock);
+      vspaceupdate(vs, addr);
+      if (mem)
+        kfree(mem);
+      break;
+    }
+    if (mem) {
+      // Multiple references to an unwritable page. Make a copy and
+      // point the vpi at it.
+      memmove(mem, old, PGSIZE);
+      vpi->writable = VPI_WRITABLE;
+      vpi->cow = 0;
+      vpi->ppn = PGNUM(V2P(mem));
+      pinned = cme->pins > 0;
+      release(&cme->lock);
+      vspaceupdate(vs, addr);
+      // Sibling threads must stop using the old frame before it goes.
+      if (vs->ref > 1)
+        tlbshootdown();
+      // Futex waiters of this process are keyed to the old frame.
+      if (pinned)
+        futexmoved(V2P(old));
+      kfree(old);
+      break;
+    }
+    // kalloc may swap, so not under the lock; then look again.
+    release(&cme->lock);
+    if (!(mem = kalloc()))
+      return -1;
+  }
+  vs->stat.cowbreaks++;
+  vs->stat.minflt++;
+  return 0;
+}
+
+// Handles a page fault at addr with error code err in vs, the current
+// process's vspace. Returns 0 if it was resolved, -1 otherwise. Caller
+// must hold the vspace's lock.
+int pagefault(struct vspace *vs, uint64_t addr, uint64_t err) {
+  struct vregion *vreg;
+  struct vpage_info *vpi;
+
+  // First touch of a page the region has reserved but not filled.
+  if ((vreg = va2vregion(vs, addr)) != 0
+      && ((vpi = va2vpage_info(vreg, addr)) == 0 || !vpi->used)) {
+    if (vspacezerofault(vs, vreg, addr, err & FEC_WR) == 0) {
+      vs->stat.minflt++;
+      return 0;
+    }
+  }
+
+  if ((vreg = va2vregion(vs, addr)) != 0
+      && (vpi = va2vpage_info(vreg, addr)) != 0 && vpi->used) {
+
+    if (vpi->present == 0 && vpi->swap == VPI_SWAP) {
+      if (swapfault(vs, vreg, addr) == 0)
+        return 0;
+
+    } else if (vpi->present == 0 && vpi->file == VPI_FILE) {
+      if (vspacefilefault(vs, vreg, addr) == 0)
+        return 0;
+
+    } else {
+      // A sibling thread made the page writable meanwhile, and this
+      // CPU still had the old translation cached.
+      if (vpi->present && !vpi->huge && (vpi->writable || !(err & FEC_WR))) {
+        vspaceupdate(vs, addr);
+        return 0;
+      }
+
+      // Copy-on-write works a page at a time, so a huge page is
+      // split first.
+      if (vpi->huge && vpi->writable == 0 && vpi->cow == 1 &&
+          vspacesplit(vs, addr, 0) < 0)
+        return -1;
+
+      if (vpi->writable == 0 && vpi->cow == 1)
+        return cowbreak(vs, addr, vpi);
+    }  
+  }
+
+  if (addr < SZ_2G && addr >= SZ_2G - 10 * PGSIZE) {
+    if (growustack(vs) != -1) {
+      vs->stat.minflt++;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Handles a page fault the kernel takes on user memory. System calls
+// fault in the memory they use beforehand (see faultin), so this
+// happens only if a sibling thread unmaps or forks meanwhile. The
+// kernel may hold spinlocks, or the vspace lock itself, so it never
+// sleeps for the lock: if another process holds it, it yields and lets
+// the access fault again, and fails if it cannot yield.
+static int kernfault(struct vspace *vs, uint64_t addr, uint64_t err) {
+  int r;
+
+  if (!tryacquiresleep(&vs->lock)) {
+    if (vs->lock.pid == myproc()->pid || mycpu()->ncli > 0)
+      return -1;
+    yield();
+    return 0;
+  }
+  r = pagefault(vs, addr, err);
+  releasesleep(&vs->lock);
+  return r;
+}
+
 void trap(struct trap_frame *tf) {
   uint64_t addr;
+  int r;
 
   if (tf->trapno == TRAP_SYSCALL) {
     if (myproc()->killed)
@@ -72,12 +199,17 @@ void trap(struct trap_frame *tf) {
 
   switch (tf->trapno) {
   case TRAP_IRQ0 + IRQ_TIMER:
-    if (cpunum() == 0) {
-      acquire(&tickslock);
-      ticks++;
-      wakeup(&ticks);
-      release(&tickslock);
-    }
+    acquire(&tickslock);
+    clockupdate();
+    release(&tickslock);
+    lapiceoi();
+    break;
+  case TRAP_RESCHED:
+    lapiceoi();
+    break;
+  case TRAP_TLBFLUSH:
+    lcr3(rcr3());
+    mycpu()->tlbflush = 0;
     lapiceoi();
     break;
   case TRAP_IRQ0 + IRQ_IDE:
@@ -107,110 +239,15 @@ void trap(struct trap_frame *tf) {
     if (tf->trapno == TRAP_PF) {
       num_page_faults += 1;
 
-      struct vregion *vreg;
-      struct vpage_info *vpi;
-      if ((vreg = va2vregion(&myproc()->vspace, addr)) != 0
-          && (vpi = va2vpage_info(vreg, addr)) != 0) {
-
-        if (vpi->present == 0 && vpi->swap == VPI_SWAP) {
-
-          // Get the se of this page
-          struct swap_entry *se = getswapentry(vpi->spn);
-          // Get a free page
-          char *mem = kalloc();
-          if (!mem) {
-            break;
-          }
-
-          // Reset its contents
-          memset(mem, 0, PGSIZE);
-
-          // Get the cme of this page
-          struct core_map_entry *cme = pa2page(V2P(mem));
-
-          // Populate the cme
-          acquire(&cme->lock);
-          cme->user = se->user;
-          cme->va = (uint64_t) se->va;
-          cme->ref_count = se->ref_count;
-          release(&cme->lock);
-
-          // Swap in data (reads and updates the vpages)
-          swapin(vpi->spn, (uint64_t) addr, (uint64_t) mem);
-
-          // Reset se
-          acquire(&se->lock);
-          se->available = 1;
-          release(&se->lock);
+      // Threads sharing the vspace fault one at a time.
+      if (myproc() && (tf->cs & 3) == DPL_USER) {
+        acquiresleep(&myproc()->vspace->lock);
+        r = pagefault(myproc()->vspace, addr, tf->err);
+        releasesleep(&myproc()->vspace->lock);
+        if (r == 0)
           break;
-
-        } else {
-          struct core_map_entry *cme = pa2page(vpi->ppn << PT_SHIFT);
-        
-      
-          // Multiple references to an unwritable page. 
-          // Make a copy and set writable to true. 
-          if (cme->ref_count > 1 && vpi->writable == 0 && vpi->cow == 1) {
-            cme->user = 0;
-
-            // Allocate a physical page, and copy the data in the current
-            // physical page to the new physical page
-            char *mem = kalloc();
-            if (!mem) {
-              break;
-            }
-
-            acquire(&cme->lock);
-
-            memset(mem, 0, PGSIZE);
-            memmove(mem, P2V(vpi->ppn << PT_SHIFT), PGSIZE);
-
-            // Make the vpi that caused the page fault point to the new 
-            // physical page
-            vpi->used = 1;
-            vpi->present = VPI_PRESENT;
-            vpi->writable = VPI_WRITABLE;
-            vpi->cow = 0;
-            vpi->swap = 0;
-            vpi->ppn = PGNUM(V2P(mem));
-
-            // decrement the reference count of the old physical page
-            cme->ref_count--;
-
-            cme->user = 1;
-
-            vspaceinvalidate(&myproc()->vspace);
-            vspaceinstall(myproc());
-
-            release(&cme->lock);
-            break;
-
-          // Last reference to this page. Set back to writable.
-          } else if (cme->ref_count == 1 && vpi->writable == 0 && vpi->cow == 1) {
-            acquire(&cme->lock);
-
-            cme->user = 0;
-
-            vpi->writable = VPI_WRITABLE;
-            vpi->cow = 0;
-            vpi->swap = 0;
-            vspaceinvalidate(&myproc()->vspace);
-            vspaceinstall(myproc());
-
-            cme->user = 1;
-
-            release(&cme->lock);
-            break;
-
-          }
-        }  
-      }
-
-      if (addr < SZ_2G && addr >= SZ_2G - 10 * PGSIZE) {
-        if (growustack() != -1) {
-          break;
-        }
-      }
+      } else if (myproc() && kernfault(myproc()->vspace, addr, tf->err) == 0)
+        break;
 
       if (myproc() == 0 || (tf->cs & 3) == 0) {
         // In kernel, it must be our mistake.
@@ -234,11 +271,22 @@ void trap(struct trap_frame *tf) {
   if (myproc() && myproc()->killed && (tf->cs & 3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // Charge the process for the time it has run on a clock interrupt,
+  // or when runqadd asks; it gives up the CPU if its quantum has run
+  // out or a process of a higher level is waiting.
   // If interrupts were on while locks held, would need to check nlock.
   if (myproc() && myproc()->state == RUNNING &&
-      tf->trapno == TRAP_IRQ0 + IRQ_TIMER)
-    yield();
+      (tf->trapno == TRAP_IRQ0 + IRQ_TIMER || mycpu()->resched)) {
+    // Sampled from user mode only, where no lock of ours is held, so
+    // that it can wait out a sibling thread's fault.
+    if (ticks - myproc()->vspace->stat.wsstamp >= WSINTERVAL &&
+        (tf->cs & 3) == DPL_USER) {
+      acquiresleep(&myproc()->vspace->lock);
+      vspacesample(myproc()->vspace);
+      releasesleep(&myproc()->vspace->lock);
+    }
+    schedtick();
+  }
 
   // Check if the process has been killed since we yielded
   if (myproc() && myproc()->killed && (tf->cs & 3) == DPL_USER)
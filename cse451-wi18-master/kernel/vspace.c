@@ -1,13 +1,38 @@
 #include <cdefs.h>
 #include <defs.h>
 #include <elf.h>
+#include <file.h>
 #include <memlayout.h>
+#include <mman.h>
+#include <param.h>
+#include <sleeplock.h>
+#include <spinlock.h>
 #include <vspace.h>
 #include <proc.h>
 #include <x86_64.h>
 #include <x86_64vm.h>
 
-// Gets the index into the linked table of vpi_pages.
+// Mappings go top-down from below the largest stack growustack allows,
+// leaving a guard page.
+#define MMAPTOP (SZ_2G - 11 * PGSIZE)
+
+// Regions made by mmap come from this pool.
+struct {
+  struct spinlock lock;
+  struct vregion regions[NVMAP];
+  struct vregion *free;
+} vmaps;
+
+// Address spaces come from this pool, so that threads can share one.
+struct {
+  struct spinlock lock;
+  struct vspace vs[NPROC];
+} vspaces;
+
+// The empty address space of kernel threads.
+struct vspace kvspace;
+
+// Gets the index of va's page in the region's page info tree.
 static int
 va2vpi_idx(struct vregion *r, uint64_t va)
 {
@@ -20,6 +45,141 @@ va2vpi_idx(struct vregion *r, uint64_t va)
   panic("va2vpi_idx: invalid direction");
 }
 
+// Inverse of va2vpi_idx.
+static uint64_t
+vpi_idx2va(struct vregion *r, uint64_t idx)
+{
+  if (r->dir == VRDIR_UP)
+    return r->va_base + idx * PGSIZE;
+  return r->va_base - (idx + 1) * PGSIZE;
+}
+
+// Number of pages a page info tree of the given height can cover.
+static uint64_t
+vpicapacity(int height)
+{
+  uint64_t n = VPIPPAGE;
+
+  while (height-- > 0)
+    n *= VPIFANOUT;
+  return n;
+}
+
+// Finds the page info for page idx of vr. If alloc is set, missing tree
+// nodes are allocated on the way, and the tree grows taller if idx is
+// beyond its reach. Returns 0 if there is no page info (or no memory).
+static struct vpage_info *
+vpilookup(struct vregion *vr, uint64_t idx, int alloc)
+{
+  struct vpi_node *node;
+  void **slot;
+  int h;
+
+  while (idx >= vpicapacity(vr->height)) {
+    if (!alloc)
+      return 0;
+    // Push the root down a level.
+    if (vr->pages) {
+      if (!(node = (struct vpi_node *)kalloc()))
+        return 0;
+      memset(node, 0, PGSIZE);
+      node->slots[0] = vr->pages;
+      vr->pages = node;
+    }
+    vr->height++;
+  }
+
+  slot = &vr->pages;
+  for (h = vr->height; ; h--) {
+    if (!*slot) {
+      if (!alloc || !(*slot = kalloc()))
+        return 0;
+      memset(*slot, 0, PGSIZE);
+    }
+    if (h == 0)
+      break;
+    slot = &((struct vpi_node *)*slot)->slots[idx / vpicapacity(h - 1)];
+    idx %= vpicapacity(h - 1);
+  }
+  return &((struct vpi_page *)*slot)->infos[idx];
+}
+
+typedef void (*vpifn)(struct vspace *, struct vregion *, uint64_t,
+                      struct vpage_info *, void *);
+
+// Calls fn on each page info in the subtree node of vr, which covers the
+// pages from base on. Only page infos in allocated leaves are visited:
+// the used ones, and the unused ones inside the region.
+static void
+vpiwalk(struct vspace *vs, struct vregion *vr, void *node, int height,
+        uint64_t base, vpifn fn, void *arg)
+{
+  struct vpage_info *vpi;
+  uint64_t i, cap, npages = vr->size / PGSIZE;
+
+  if (!node)
+    return;
+
+  if (height == 0) {
+    for (i = 0; i < VPIPPAGE; i++) {
+      vpi = &((struct vpi_page *)node)->infos[i];
+      if (vpi->used || base + i < npages)
+        fn(vs, vr, vpi_idx2va(vr, base + i), vpi, arg);
+    }
+    return;
+  }
+
+  cap = vpicapacity(height - 1);
+  for (i = 0; i < VPIFANOUT; i++)
+    vpiwalk(vs, vr, ((struct vpi_node *)node)->slots[i], height - 1,
+            base + i * cap, fn, arg);
+}
+
+// Calls fn on the page infos of every region of vs, as vpiwalk does.
+static void
+vspacewalk(struct vspace *vs, vpifn fn, void *arg)
+{
+  struct vregion *vr;
+
+  for_each_vregion(vr, vs)
+    vpiwalk(vs, vr, vr->pages, vr->height, 0, fn, arg);
+}
+
+// Returns the region after vr in vs: the fixed regions come first, then
+// the mappings. Returns 0 after the last.
+struct vregion *
+vregionnext(struct vspace *vs, struct vregion *vr)
+{
+  if (vr >= vs->regions && vr < &vs->regions[NREGIONS - 1])
+    return vr + 1;
+  if (vr == &vs->regions[NREGIONS - 1])
+    return vs->maps;
+  return vr->next;
+}
+
+static struct vregion *
+vmapalloc(void)
+{
+  struct vregion *vr;
+
+  acquire(&vmaps.lock);
+  if ((vr = vmaps.free))
+    vmaps.free = vr->next;
+  release(&vmaps.lock);
+  if (vr)
+    memset(vr, 0, sizeof(*vr));
+  return vr;
+}
+
+static void
+vmapfree(struct vregion *vr)
+{
+  acquire(&vmaps.lock);
+  vr->next = vmaps.free;
+  vmaps.free = vr;
+  release(&vmaps.lock);
+}
+
 // Creates the architecture specific page permision bits.
 static int
 x86perms(struct vpage_info *vpi)
@@ -34,14 +194,134 @@ x86perms(struct vpage_info *vpi)
 
 extern pml4e_t *kpml4;
 
+// A page of zeros that untouched pages map until they are written.
+static char *zeropage;
+
 // To be called at initialization time only. Will set up the
 // kernel page table and the segment table.
 void
 vspacebootinit(void)
 {
-  kpml4 = setupkvm();
+  struct vregion *vr;
+  struct vspace *vs;
+
+  kvmalloc();
   vspaceinstallkern();
   seginit();   // segment table
+
+  if (!(zeropage = kalloc()))
+    panic("vspacebootinit: zero page");
+  memset(zeropage, 0, PGSIZE);
+
+  initlock(&vmaps.lock, "vmaps");
+  for (vr = vmaps.regions; vr < &vmaps.regions[NVMAP]; vr++)
+    vmapfree(vr);
+
+  initlock(&vspaces.lock, "vspaces");
+  for (vs = vspaces.vs; vs < &vspaces.vs[NPROC]; vs++)
+    initsleeplock(&vs->lock, "vspace");
+  initsleeplock(&kvspace.lock, "kvspace");
+}
+
+// Returns a new, initialized vspace holding one reference, or 0.
+struct vspace *
+vspacealloc(void)
+{
+  struct vspace *vs;
+
+  acquire(&vspaces.lock);
+  for (vs = vspaces.vs; vs < &vspaces.vs[NPROC]; vs++)
+    if (vs->ref == 0)
+      break;
+  if (vs == &vspaces.vs[NPROC]) {
+    release(&vspaces.lock);
+    return 0;
+  }
+  vs->ref = 1;
+  release(&vspaces.lock);
+
+  if (vspaceinit(vs) < 0) {
+    acquire(&vspaces.lock);
+    vs->ref = 0;
+    release(&vspaces.lock);
+    return 0;
+  }
+  return vs;
+}
+
+// Adds a reference to vs for a thread that shares it.
+struct vspace *
+vspacedup(struct vspace *vs)
+{
+  acquire(&vspaces.lock);
+  vs->ref++;
+  release(&vspaces.lock);
+  return vs;
+}
+
+// Drops a reference to vs. The last one writes its shared file pages
+// back and frees it; vs must not be installed then.
+void
+vspacerelease(struct vspace *vs)
+{
+  acquire(&vspaces.lock);
+  if (vs->ref > 1) {
+    vs->ref--;
+    release(&vspaces.lock);
+    return;
+  }
+  // Nobody else can take a reference to it now; wait for the swapper
+  // to be done with its pages.
+  vs->ref = -1;
+  while (vs->swaprefs > 0)
+    sleep(&vs->swaprefs, &vspaces.lock);
+  release(&vspaces.lock);
+
+  vspacemsync(vs, 0, SZ_2G);
+  vspacefree(vs);
+  acquire(&vspaces.lock);
+  vs->ref = 0;
+  release(&vspaces.lock);
+}
+
+// Takes a reference to vs for the swapper, which evicts pages of
+// vspaces other than its own, unless vs is free or being freed.
+// Returns 1 if it did. Freeing vs waits until vspaceput drops it.
+int
+vspaceget(struct vspace *vs)
+{
+  int r;
+
+  acquire(&vspaces.lock);
+  if ((r = vs->ref > 0))
+    vs->swaprefs++;
+  release(&vspaces.lock);
+  return r;
+}
+
+// Drops a reference vspaceget took.
+void
+vspaceput(struct vspace *vs)
+{
+  acquire(&vspaces.lock);
+  if (--vs->swaprefs == 0)
+    wakeup(&vs->swaprefs);
+  release(&vspaces.lock);
+}
+
+// Returns the number of vspaces with resident pages.
+int
+vspacesresident(void)
+{
+  struct vspace *vs;
+  int n = 0;
+
+  acquire(&vspaces.lock);
+  for (vs = vspaces.vs; vs < &vspaces.vs[NPROC]; vs++)
+    if (vs->ref > 0 && vs->stat.rss > 0)
+      n++;
+  release(&vspaces.lock);
+  return n;
 }
 
 // Should be called before any vspace functions are used on a vspace.
@@ -63,6 +343,10 @@ vspaceinit(struct vspace *vs)
   vs->regions[VR_CODE].dir   = VRDIR_UP;
   vs->regions[VR_HEAP].dir   = VRDIR_UP;
   vs->regions[VR_USTACK].dir = VRDIR_DOWN;
+  vs->maps = 0;
+
+  memset(&vs->stat, 0, sizeof(vs->stat));
+  vs->stat.wsstamp = ticks;
 
   return 0;
 }
@@ -83,7 +367,7 @@ vregionaddmap(struct vregion *vr, uint64_t from_va, uint64_t sz, short present,
     return 0;
 
   for (a = PGROUNDUP(from_va); a < from_va + sz; a += PGSIZE) {
-    if (!(vpi = va2vpage_info(vr, a)))
+    if (!(vpi = va2vpage_info_alloc(vr, a)))
       return -1;
 
     mem = kalloc();
@@ -99,31 +383,78 @@ vregionaddmap(struct vregion *vr, uint64_t from_va, uint64_t sz, short present,
   return sz;
 }
 
-// Will remove the mapping from a vregion and free all pages in the
-// virtual address range (from_va - size, from_va]
-int
-vregiondelmap(struct vregion *vr, uint64_t from_va, uint64_t sz)
+// Backs the untouched, PD_SIZE-aligned stretch [va, va + PD_SIZE) of vr
+// with a zeroed, writable huge page. Returns 0 on success, -1 if part of
+// it is in use or no contiguous memory is free.
+static int
+vregionaddhuge(struct vregion *vr, uint64_t va)
 {
-  uint64_t a;
   struct vpage_info *vpi;
+  char *mem;
+  uint64_t i;
 
-  if (!vregioncontains(vr, from_va - sz, 0))
+  for (i = 0; i < PTRS_PER_PT; i++)
+    if (!(vpi = va2vpage_info_alloc(vr, va + i * PGSIZE)) || vpi->used)
+      return -1;
+  if (!(mem = kallochuge()))
     return -1;
-  if (sz <= 0)
-    return 0;
+  memset(mem, 0, PD_SIZE);
 
-  for (a = PGROUNDDOWN(from_va); a > from_va - sz; a -= PGSIZE) {
-    if (!(vpi = va2vpage_info(vr, a)))
-      return -1;
+  for (i = 0; i < PTRS_PER_PT; i++) {
+    vpi = va2vpage_info(vr, va + i * PGSIZE);
+    vpi->used = 1;
+    vpi->huge = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->writable = VPI_WRITABLE;
+    vpi->ppn = PGNUM(V2P(mem)) + i;
+  }
+  return 0;
+}
 
-    assertm(vpi->used, "address isn't assigned");
+// Handles the first touch of the page at va in vr, which has no page
+// yet: regions grow by reserving address space only, and their pages
+// are zero-filled on demand. A read maps the shared zero page
+// copy-on-write, so memory is only spent on pages that are written.
+// On a write, if the aligned 2 MiB around va lies in the heap and is
+// untouched, it gets a huge page when contiguous memory is free.
+// Returns 0 on success, -1 if out of memory or vr is read-only.
+int
+vspacezerofault(struct vspace *vs, struct vregion *vr, uint64_t va, int write)
+{
+  uint64_t base = va & ~(PD_SIZE - 1);
+  struct core_map_entry *cme;
+  struct vpage_info *vpi;
 
-    vpi->used = 0;
-    vpi->present = 0;
+  va = PGROUNDDOWN(va);
+  if (write && vr->readonly)
+    return -1;
+  if (!write) {
+    if (!(vpi = va2vpage_info_alloc(vr, va)))
+      return -1;
+    cme = pa2page(V2P(zeropage));
+    acquire(&cme->lock);
+    cme->ref_count++;
+    release(&cme->lock);
+
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
     vpi->writable = 0;
-    kfree(P2V(vpi->ppn << PT_SHIFT));
+    vpi->cow = vr->readonly ? 0 : VPI_COW;
+    vpi->ppn = PGNUM(V2P(zeropage));
+    vspaceupdate(vs, va);
+    return 0;
   }
-  return sz;
+
+  if (vr == &vs->regions[VR_HEAP] && base >= VRBOT(vr) && base + PD_SIZE <= VRTOP(vr) &&
+      vregionaddhuge(vr, base) == 0) {
+    vspaceupdate(vs, base);
+    return 0;
+  }
+
+  if (vregionaddmap(vr, va, PGSIZE, VPI_PRESENT, VPI_WRITABLE) < 0)
+    return -1;
+  vspaceupdate(vs, va);
+  return 0;
 }
 
 // Maps data from [data, data + sz) into [va, va + sz)
@@ -146,23 +477,74 @@ vradddata(struct vregion *r, uint64_t va, char *data, int sz, short present, sho
   return 0;
 }
 
-// Loads data from an inode into [va, va + sz)
+// Backs [va, va + sz) with the data at offset in the region's file.
+// Nothing is read yet: each page is filled on its first fault.
 // va must be page aligned
 static int
-vrloaddata(struct vregion *r, uint64_t va, struct inode *ip, uint offset, uint sz)
+vrfiledata(struct vregion *r, uint64_t va, uint offset, uint sz, short writable)
 {
-  uint i, n;
+  uint i;
   struct vpage_info *vpi;
   assertm(va % PGSIZE == 0, "va must be page aligned");
 
   for (i = 0; i < sz; i += PGSIZE) {
-    vpi = va2vpage_info(r, va + i);
-    assertm(vpi->used, "page must be allocated");
-    n = min(sz - i, (uint) PGSIZE);
-    if (readi(ip, P2V(vpi->ppn << PT_SHIFT), offset + i, n) != n)
+    if (!(vpi = va2vpage_info_alloc(r, va + i)))
+      return -1;
+    vpi->used = 1;
+    vpi->file = VPI_FILE;
+    vpi->present = 0;
+    vpi->writable = writable;
+    vpi->fileoff = offset + i;
+    vpi->filelen = min(sz - i, (uint) PGSIZE);
+  }
+
+  return 0;
+}
+
+// Handles the first touch of a file page at va in vr. The page comes
+// from the file page cache, shared with every other process running
+// or mapping the same file, and is mapped copy-on-write unless vr is
+// shared. A private page whose data ends before the cached page's
+// does, as the last page of a program segment may, gets a copy of its
+// own with the rest zeroed. Counts a major fault if the file had to be
+// read. Returns 0 on success, -1 if out of memory or the read fails.
+int
+vspacefilefault(struct vspace *vs, struct vregion *vr, uint64_t va)
+{
+  struct vpage_info *vpi;
+  char *mem, *copy;
+  int cached;
+
+  va = PGROUNDDOWN(va);
+  vpi = va2vpage_info(vr, va);
+  if (!(mem = pcacheget(vr->ip, vpi->fileoff, vr->shared, &cached)))
+    return -1;
+  if (cached)
+    vs->stat.minflt++;
+  else
+    vs->stat.majflt++;
+
+  if (!vr->shared && vpi->filelen < PGSIZE &&
+      vpi->fileoff + vpi->filelen < vr->ip->size) {
+    if (!(copy = kalloc())) {
+      kfree(mem);
       return -1;
+    }
+    memmove(copy, mem, vpi->filelen);
+    memset(copy + vpi->filelen, 0, PGSIZE - vpi->filelen);
+    kfree(mem);
+    mem = copy;
   }
 
+  vpi->file = 0;
+  vpi->fileoff = vpi->filelen = 0;
+  vpi->present = VPI_PRESENT;
+  if (vpi->writable && !vr->shared) {
+    vpi->writable = 0;
+    vpi->cow = VPI_COW;
+  }
+  vpi->ppn = PGNUM(V2P(mem));
+  vspaceupdate(vs, va);
   return 0;
 }
 
@@ -200,7 +582,8 @@ vspaceinitcode(struct vspace *vs, char *init, uint64_t size)
 
 // This will load the code into a vspace from a file found by path.
 // The return parameter rip is the point where the program should start
-// executing.
+// executing. The code region holds on to the file: its pages are read
+// in as they are touched, and the bss is zero-filled on demand.
 //
 // NOTE: The vspace is not invalidated (Due to the likelihood of of a vspace being
 // changed more before it is to be installed). You must invalidate before installing.
@@ -210,7 +593,6 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
   struct inode *ip;
   struct proghdr ph;
   int off, sz;
-  uint64_t va;
   struct elfhdr elf;
   int i;
 
@@ -227,8 +609,8 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
   // Set start bound
   vs->regions[VR_CODE].va_base = 0;
 
-  // Load program into memory.
-  va = 0;
+  // Map the program's segments.
+  sz = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
       goto elf_failure;
@@ -238,25 +620,23 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
       goto elf_failure;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto elf_failure;
-
-    if((sz = vregionaddmap(&vs->regions[VR_CODE], (uint64_t)va, ph.vaddr + ph.memsz, VPI_PRESENT, VPI_WRITABLE)) < 0)
-     goto elf_failure;
+    if(ph.vaddr + ph.memsz >= KERNBASE)
+      goto elf_failure;
     if(ph.vaddr % PGSIZE != 0)
       goto elf_failure;
 
-    va += sz;
-
-    if(vrloaddata(&vs->regions[VR_CODE], ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(vrfiledata(&vs->regions[VR_CODE], ph.vaddr, ph.off, ph.filesz, VPI_WRITABLE) < 0)
      goto elf_failure;
+    sz = max(sz, (int)(ph.vaddr + ph.memsz));
   }
 
   // Set end bound;
   vs->regions[VR_CODE].size = PGROUNDUP(sz);
+  vs->regions[VR_CODE].ip = ip;
   // The heap will be right after the code
   vs->regions[VR_HEAP].va_base = PGROUNDUP(sz);
   vs->regions[VR_HEAP].size = 0;
 
-  irelease(ip);
   *rip = elf.entry;
   return sz;
 elf_failure:
@@ -266,39 +646,179 @@ elf_failure:
   return 0;
 }
 
+// Records vs as the owner of the page behind vpi if it is private.
+// Only owned pages can be evicted by the swapper.
+static void
+vpiown(struct vspace *vs, struct vpage_info *vpi)
+{
+  struct core_map_entry *cme = pa2page(vpi->ppn << PT_SHIFT);
+
+  cme->vs = cme->ref_count == 1 ? vs : 0;
+}
+
+// Maps the huge page starting at va, whose page infos are in vr, with
+// one PDE, replacing the page table that mapped the range before, if
+// any. Keeps the accessed bit. Returns the number of pages of the
+// range that were mapped before.
+static int
+hugemap(struct vspace *vs, struct vregion *vr, uint64_t va)
+{
+  struct vpage_info *vpi;
+  pde_t *pde;
+  pte_t *pgtab;
+  int i, n = 0, accessed = 0;
+
+  if (!(pde = walkpgdir(vs->pgtbl, (char *)va, 1)))
+    panic("not enough memory");
+
+  if ((*pde & PTE_P) && (*pde & PTE_PS)) {
+    n = PTRS_PER_PT;
+    accessed = *pde & PTE_A;
+  } else if (*pde & PTE_P) {
+    pgtab = P2V(PTE_ADDR(*pde));
+    for (i = 0; i < PTRS_PER_PT; i++) {
+      if (pgtab[i] & PTE_P)
+        n++;
+      accessed |= pgtab[i] & PTE_A;
+    }
+    kfree((char *)pgtab);
+  }
+
+  vpi = va2vpage_info(vr, va);
+  *pde = PTE(vpi->ppn << PT_SHIFT, x86perms(vpi) | PTE_PS | accessed);
+  for (i = 0; i < PTRS_PER_PT; i++, va += PGSIZE) {
+    vpi = va2vpage_info(vr, va);
+    mark_user_mem(vpi->ppn << PT_SHIFT, va);
+    vpiown(vs, vpi);
+  }
+  return n;
+}
+
+static void
+invalidate1(struct vspace *vs, struct vregion *vr, uint64_t va,
+            struct vpage_info *vpi, void *arg)
+{
+  pte_t *pte;
+  int accessed = 0;
+
+  // The PDE of a huge page is set up along with its first page.
+  if (vpi->used && vpi->huge) {
+    if (va % PD_SIZE == 0) {
+      hugemap(vs, vr, va);
+      vs->stat.huge++;
+    }
+    vs->stat.rss++;
+    return;
+  }
+
+  if ((pte = walkpml4(vs->pgtbl, (char *)va, 0))) {
+    if (vpi->used)
+      accessed = *pte & (PTE_A | PTE_D); // msync looks for PTE_D
+    *pte = 0;
+  }
+  if (vpi->used && vpi->swap == VPI_SWAP && !vpi->present)
+    vs->stat.swapped++;
+  if (vpi->present) {
+    vs->stat.rss++;
+    mappages(vs->pgtbl, va >> PT_SHIFT, 1, vpi->ppn, x86perms(vpi)|accessed, 0);
+    vpiown(vs, vpi);
+  }
+}
+
 // This will do the necessary processing to transform a vspace
 // into the architecture dependent page table. Must be called after
-// any changes are made that affect the mappings in a vspace.
+// any changes are made that affect the mappings in a vspace. When
+// only a few pages change, use vspaceupdate on each instead.
 void
 vspaceinvalidate(struct vspace *vs)
+{
+  vs->stat.rss = vs->stat.swapped = vs->stat.huge = 0;
+  vspacewalk(vs, invalidate1, 0);
+}
+
+// Brings the PTE of the page at va in line with its page info, and
+// flushes the old translation if vs is the current address space.
+// A page outside every region is unmapped.
+void
+vspaceupdate(struct vspace *vs, uint64_t va)
 {
   struct vregion *vr;
-  struct vpage_info *vpi;
+  struct vpage_info *vpi = 0;
   pte_t *pte;
-  uint64_t start, end;
-  int accessed;
+  int accessed = 0, n;
 
-  for (vr = vs->regions; vr < &vs->regions[NREGIONS]; vr++) {
-    start = VRBOT(vr);
-    end = VRTOP(vr);
-
-    assert(start % PGSIZE == 0);
-
-    for (; start < end; start += PGSIZE) {
-      vpi = va2vpage_info(vr, start);
-      pte = walkpml4(vs->pgtbl, (char *)start, 0);
-      accessed = 0;
-      if (pte) {
-        if (vpi->used)
-          accessed = *pte & PTE_A;
-        *pte = 0;
-      }
-      if (vpi->present) {
-        mappages(vs->pgtbl, start >> PT_SHIFT, 1, vpi->ppn, x86perms(vpi)|accessed, 0);
-        accessed = 0;
-      }
+  va = PGROUNDDOWN(va);
+  if ((vr = va2vregion(vs, va)))
+    vpi = va2vpage_info(vr, va);
+
+  if (vpi && vpi->huge) {
+    va &= ~(PD_SIZE - 1);
+    pte = walkpml4(vs->pgtbl, (char *)va, 0);
+    if (pte && (*pte & PTE_PS))
+      return; // already mapped by its PDE
+    n = hugemap(vs, vr, va);
+    vs->stat.rss += PTRS_PER_PT - n;
+    vs->stat.huge++;
+    if (myproc() && vs == myproc()->vspace)
+      lcr3(V2P(vs->pgtbl));
+    return;
+  }
+
+  if ((pte = walkpml4(vs->pgtbl, (char *)va, 0))) {
+    if (*pte & PTE_P) {
+      vs->stat.rss--;
+      accessed = *pte & (PTE_A | PTE_D);
     }
+    *pte = 0;
+  }
+  if (vpi && vpi->present) {
+    vs->stat.rss++;
+    mappages(vs->pgtbl, va >> PT_SHIFT, 1, vpi->ppn, x86perms(vpi)|accessed, 0);
+    vpiown(vs, vpi);
+  }
+
+  if (myproc() && vs == myproc()->vspace)
+    invlpg((void *)va);
+}
+
+// Breaks the huge page holding va back into PTRS_PER_PT pages mapped by
+// the page table page pt, or by a newly allocated one if pt is 0. The
+// frames stay where they are, so this is needed before any one page
+// of a huge page is copied, swapped out or remapped on its own.
+// Returns 0 on success, -1 if out of memory.
+int
+vspacesplit(struct vspace *vs, uint64_t va, char *pt)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  pde_t *pde;
+  pte_t *pgtab;
+  int i, accessed;
+
+  va &= ~(PD_SIZE - 1);
+  if (!(vr = va2vregion(vs, va)) || !(vpi = va2vpage_info(vr, va)) || !vpi->huge)
+    panic("vspacesplit: not a huge page");
+  if (!pt && !(pt = kalloc()))
+    return -1;
+
+  pde = walkpgdir(vs->pgtbl, (char *)va, 0);
+  accessed = *pde & PTE_A;
+  pgtab = (pte_t *)pt;
+  for (i = 0; i < PTRS_PER_PT; i++) {
+    vpi = va2vpage_info(vr, va + i * PGSIZE);
+    vpi->huge = 0;
+    pgtab[i] = PTE(vpi->ppn << PT_SHIFT, x86perms(vpi) | accessed);
   }
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  vs->stat.huge--;
+
+  // One invlpg drops the whole 2 MiB translation. Sibling threads on
+  // other CPUs must drop theirs too.
+  if (myproc() && vs == myproc()->vspace)
+    invlpg((void *)va);
+  if (vs->ref > 1)
+    tlbshootdown();
+  return 0;
 }
 
 // Given a vspace (must be initialized) install the page table into
@@ -311,12 +831,12 @@ vspaceinstall(struct proc *p)
     panic("mrinstall: null proc");
   if (!p->kstack)
     panic("mrinstall: null kstack");
-  if (!p->vspace.pgtbl)
+  if (!p->vspace->pgtbl)
     panic("mrinstall: page table not initialized");
 
   pushcli();
   mycpu()->ts.rsp0 = (uint64_t)p->kstack + KSTACKSIZE;
-  lcr3(V2P(p->vspace.pgtbl));
+  lcr3(V2P(p->vspace->pgtbl));
   popcli();
 }
 
@@ -327,51 +847,51 @@ vspaceinstallkern(void)
   lcr3(V2P(kpml4));
 }
 
-// Frees the vpi_page linked table.
+// Frees a page info tree, releasing the swap slots it refers to.
 static void
-free_page_desc_list(struct vpi_page *page)
+vpifree(void *node, int height)
 {
-  assert((uint64_t) page % PGSIZE == 0);
-
-  if (!page)
-    return;
-
   struct vpage_info *vpi;
-  for (vpi = &page->infos[0]; vpi < &page->infos[VPIPPAGE]; vpi++) {
-    if (vpi->swap == VPI_SWAP && vpi->present == 0) {
-      struct swap_entry *se = getswapentry(vpi->spn);
-      acquire(&se->lock);
-
-      if (se->ref_count <= 1) {
-
-        pages_in_swap--;
-
-        se->available = 1;
-        se->user = 0;
-        se->va = 0;
-        se->ref_count = 0;
+  int i;
 
-      } else {
-        se->ref_count--;
-      }
+  if (!node)
+    return;
 
-      release(&se->lock);
+  if (height == 0) {
+    for (vpi = &((struct vpi_page *)node)->infos[0];
+         vpi < &((struct vpi_page *)node)->infos[VPIPPAGE]; vpi++) {
+      if (vpi->swap == VPI_SWAP && vpi->present == 0)
+        swapfree(vpi->spn);
     }
+  } else {
+    for (i = 0; i < VPIFANOUT; i++)
+      vpifree(((struct vpi_node *)node)->slots[i], height - 1);
   }
+  kfree((char *)node);
+}
 
-  free_page_desc_list(page->next);
-  kfree((char *)page);
+// Frees the page infos of vr and drops its file.
+static void
+vrfree(struct vregion *vr)
+{
+  vpifree(vr->pages, vr->height);
+  if (vr->ip)
+    irelease(vr->ip);
+  memset(vr, 0, sizeof(struct vregion));
 }
 
 void 
 vregionfree(struct vspace *vs) {
   struct vregion *vr;
 
-  for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++) {
-    free_page_desc_list(vr->pages);
-    memset(vr, 0, sizeof(struct vregion));
-  }
+  for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++)
+    vrfree(vr);
 
+  while ((vr = vs->maps)) {
+    vs->maps = vr->next;
+    vrfree(vr);
+    vmapfree(vr);
+  }
 }
 
 // Frees all the memory a vspace is consuming.
@@ -379,13 +899,7 @@ vregionfree(struct vspace *vs) {
 void
 vspacefree(struct vspace *vs)
 {
-  struct vregion *vr;
-
-  for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++) {
-    free_page_desc_list(vr->pages);
-    memset(vr, 0, sizeof(struct vregion));
-  }
-
+  vregionfree(vs);
   freevm(vs->pgtbl);
 }
 
@@ -396,7 +910,7 @@ va2vregion(struct vspace *vs, uint64_t va)
 {
   struct vregion *vr;
 
-  for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++) {
+  for_each_vregion(vr, vs) {
     if (vr->dir == VRDIR_UP) {
       if (va >= vr->va_base && va < vr->va_base + vr->size)
         return vr;
@@ -409,34 +923,19 @@ va2vregion(struct vspace *vs, uint64_t va)
 }
 
 // Given a vregion and virtual address, find the page info struct
-// associated with that virutal address.
+// associated with that virutal address. Returns 0 if the page has none.
 struct vpage_info*
 va2vpage_info(struct vregion *vr, uint64_t va)
 {
-  int idx;
-  struct vpi_page *info;
-
-  if (!vr->pages) {
-    vr->pages = (struct vpi_page *)kalloc();
-    memset(vr->pages, 0, PGSIZE);
-  }
-
-  idx = va2vpi_idx(vr, va);
-  info = vr->pages;
-
-  while (idx >= VPIPPAGE) {
-    assertm(info, "idx was out of bounds");
-    if (!info->next) {
-      info->next = (struct vpi_page *)kalloc();
-      if (!info->next)
-        return 0;
-      memset(info->next, 0, PGSIZE);
-    }
-    info = info->next;
-    idx -= VPIPPAGE;
-  }
+  return vpilookup(vr, va2vpi_idx(vr, va), 0);
+}
 
-  return &info->infos[idx];
+// Like va2vpage_info, but creates the page info if it doesn't exist.
+// Returns 0 if out of memory.
+struct vpage_info*
+va2vpage_info_alloc(struct vregion *vr, uint64_t va)
+{
+  return vpilookup(vr, va2vpi_idx(vr, va), 1);
 }
 
 // Tests if a vregion has [va, va + size) mapped in it's virtual address space.
@@ -456,132 +955,362 @@ vspacecontains(struct vspace *vs, uint64_t va, int size)
   return vregioncontains(vr, va, size);
 }
 
-// Does a linked list style copy of the values.
+// Makes dstvpi share the page behind srcvpi, copy-on-write.
+static int
+shallow_copy_vpi(struct vpage_info *dstvpi, struct vpage_info *srcvpi)
+{
+  dstvpi->used = srcvpi->used;
+  dstvpi->present = srcvpi->present;
+  dstvpi->huge = srcvpi->huge;
+
+  // A page not read yet has no frame to share; both read it when
+  // touched.
+  if (srcvpi->file == VPI_FILE) {
+    dstvpi->writable = srcvpi->writable;
+    dstvpi->file = VPI_FILE;
+    dstvpi->fileoff = srcvpi->fileoff;
+    dstvpi->filelen = srcvpi->filelen;
+    return 0;
+  }
+
+  // set cow to true
+  dstvpi->cow = srcvpi->cow = VPI_COW;
+
+  // set writable to false.
+  dstvpi->writable = srcvpi->writable = 0;
+
+  // Copy ppn and update ref_count.
+  dstvpi->ppn = srcvpi->ppn;
+  dstvpi->spn = srcvpi->spn;
+  dstvpi->swap = srcvpi->swap;
+
+  // if page is in swap, update swap entry ref_count
+  if (srcvpi->swap == VPI_SWAP) {
+    swapdup(srcvpi->spn);
+  // else, update cme ref_count
+  } else {
+    struct core_map_entry *cme = pa2page(srcvpi->ppn << PT_SHIFT);
+    acquire(&cme->lock);
+    cme->ref_count++;
+    release(&cme->lock);
+  }
+  return 0;
+}
+
+// Makes dstvpi map the same page as srcvpi, for a shared mapping:
+// writes through either are seen by both.
+static int
+share_vpi(struct vpage_info *dstvpi, struct vpage_info *srcvpi)
+{
+  struct core_map_entry *cme;
+
+  // Pages of shared mappings are never swapped, so a page that is not
+  // present has not been read from its file yet.
+  if (!srcvpi->present)
+    return shallow_copy_vpi(dstvpi, srcvpi);
+
+  *dstvpi = *srcvpi;
+  cme = pa2page(srcvpi->ppn << PT_SHIFT);
+  acquire(&cme->lock);
+  cme->ref_count++;
+  release(&cme->lock);
+  return 0;
+}
+
+// Copies the page info tree src into *dst, applying copy to each used
+// page info.
 static int
-copy_vpi_page(struct vpi_page **dst, struct vpi_page *src)
+vpicopy(void **dst, void *src, int height,
+        int (*copy)(struct vpage_info *, struct vpage_info *))
 {
   int i;
-  char *data;
-  struct vpage_info *srcvpi, *dstvpi;
 
   if (!src) {
     *dst = 0;
     return 0;
   }
 
-  if (!(*dst = (struct vpi_page *)kalloc()))
+  if (!(*dst = kalloc()))
     return -1;
+  memset(*dst, 0, PGSIZE);
 
-  memset(*dst, 0, sizeof(struct vpi_page));
-
-  for (i = 0; i < VPIPPAGE; i++) {
-    srcvpi = &src->infos[i];
-    dstvpi = &(*dst)->infos[i];
-    if (srcvpi->used) {
-      dstvpi->used = srcvpi->used;
-      dstvpi->present = srcvpi->present;
-      dstvpi->writable = srcvpi->writable;
-      dstvpi->swap = 0;
-      if (!(data = kalloc()))
+  if (height == 0) {
+    for (i = 0; i < VPIPPAGE; i++)
+      if (((struct vpi_page *)src)->infos[i].used &&
+          copy(&((struct vpi_page *)*dst)->infos[i],
+               &((struct vpi_page *)src)->infos[i]) < 0)
         return -1;
-      memmove(data, P2V(srcvpi->ppn << PT_SHIFT), PGSIZE);
-      dstvpi->ppn = PGNUM(V2P(data));
-    }
+    return 0;
   }
 
-  return copy_vpi_page(&(*dst)->next, src->next);
+  for (i = 0; i < VPIFANOUT; i++)
+    if (vpicopy(&((struct vpi_node *)*dst)->slots[i],
+                ((struct vpi_node *)src)->slots[i], height - 1, copy) < 0)
+      return -1;
+  return 0;
 }
 
+// Copies the region src into dst, applying copy to its used page
+// infos. The pages of a shared mapping are shared instead.
 static int
-shallow_copy_vpi_page(struct vpi_page **dst, struct vpi_page *src)
+vregioncopy(struct vregion *dst, struct vregion *src,
+            int (*copy)(struct vpage_info *, struct vpage_info *))
 {
+  *dst = *src;
+  dst->next = 0;
+  if (dst->ip)
+    idup(dst->ip);
+  return vpicopy(&dst->pages, src->pages, src->height,
+                 src->shared ? share_vpi : copy);
+}
+
+// Copies every region of src, mappings included, into dst.
+static int
+vregionscopy(struct vspace *dst, struct vspace *src,
+             int (*copy)(struct vpage_info *, struct vpage_info *))
+{
+  struct vregion *vr, **pp;
   int i;
-  struct vpage_info *srcvpi, *dstvpi;
 
-  if (!src) {
-    *dst = 0;
-    return 0;
+  for (i = 0; i < NREGIONS; i++)
+    if (vregioncopy(&dst->regions[i], &src->regions[i], copy) < 0)
+      return -1;
+
+  pp = &dst->maps;
+  for (vr = src->maps; vr; vr = vr->next) {
+    if (!(*pp = vmapalloc()) || vregioncopy(*pp, vr, copy) < 0)
+      return -1;
+    pp = &(*pp)->next;
   }
+  return 0;
+}
 
-  if (!(*dst = (struct vpi_page *)kalloc()))
+int
+vspaceshallowcopy(struct vspace *dst, struct vspace *src)
+{
+  if (vregionscopy(dst, src, shallow_copy_vpi) < 0)
     return -1;
 
-  memset(*dst, 0, sizeof(struct vpi_page));
-
-  // Copy vpage_infos and set writable to false.
-  for (i = 0; i < VPIPPAGE; i++) {
-    srcvpi = &src->infos[i];
-    dstvpi = &(*dst)->infos[i];
-
-    if (srcvpi->used) {
-      dstvpi->used = srcvpi->used;
-      dstvpi->present = srcvpi->present;
-
-      // set cow to true
-      dstvpi->cow = srcvpi->cow = VPI_COW;
-
-      // set writable to false.
-      dstvpi->writable = srcvpi->writable = 0;
-
-      // Copy ppn and update ref_count.
-      dstvpi->ppn = srcvpi->ppn;
-      dstvpi->spn = srcvpi->spn;
-      dstvpi->swap = srcvpi->swap;
-     
-     // if page is in swap, update swap entry ref_count 
-     if (srcvpi->swap == VPI_SWAP) {
- 
-        struct swap_entry *se = getswapentry(srcvpi->spn);
-        acquire(&se->lock);
-        se->ref_count++;
-        release(&se->lock); 
-      // else, update cme ref_count
-      } else {
-        struct core_map_entry *cme = pa2page(srcvpi->ppn << PT_SHIFT);
-        acquire(&cme->lock);
-        cme->ref_count++;
-        release(&cme->lock);
-      }
-    }
+  vspaceinvalidate(dst);
+
+  return 0;
+}
+
+// Returns the highest address the heap may grow to: the bottom of the
+// lowest mapping, or the bottom of the largest stack.
+uint64_t
+vspaceheaplimit(struct vspace *vs)
+{
+  struct vregion *vr;
+
+  if (!vs->maps)
+    return SZ_2G - 10 * PGSIZE;
+  for (vr = vs->maps; vr->next; vr = vr->next)
+    ;
+  return VRBOT(vr);
+}
+
+// Unmaps the page at va if it is at or above *(uint64_t *)arg, freeing
+// its frame or swap slot.
+static void
+unmap1(struct vspace *vs, struct vregion *vr, uint64_t va,
+       struct vpage_info *vpi, void *arg)
+{
+  pte_t *pte;
+
+  if (va < *(uint64_t *)arg || !vpi->used)
+    return;
+
+  if ((pte = walkpml4(vs->pgtbl, (char *)va, 0)) && (*pte & PTE_P)) {
+    *pte = 0;
+    vs->stat.rss--;
+  }
+  if (vpi->present)
+    kfree(P2V(vpi->ppn << PT_SHIFT));
+  else if (vpi->swap == VPI_SWAP) {
+    swapfree(vpi->spn);
+    vs->stat.swapped--;
   }
+  memset(vpi, 0, sizeof(*vpi));
+}
 
-  return shallow_copy_vpi_page(&(*dst)->next, src->next);
+// Adds an empty mapping of len bytes, a multiple of PGSIZE, to vs in
+// the highest gap below the stack and above the heap that fits it.
+// Returns the region, or 0.
+static struct vregion *
+vmapinsert(struct vspace *vs, uint64_t len)
+{
+  struct vregion *vr, **pp;
+  uint64_t top;
+
+  top = MMAPTOP;
+  for (pp = &vs->maps; *pp; pp = &(*pp)->next) {
+    if (top - VRTOP(*pp) >= len)
+      break;
+    top = VRBOT(*pp);
+  }
+  if (len > top || top - len < VRTOP(&vs->regions[VR_HEAP]))
+    return 0;
+  if (!(vr = vmapalloc()))
+    return 0;
 
+  vr->dir = VRDIR_UP;
+  vr->va_base = top - len;
+  vr->size = len;
+  vr->next = *pp;
+  *pp = vr;
+  return vr;
 }
 
-// Copies all the mappings from src to dst. While the virtual addresses
-// are the same and the data is the same, the mapped pages are
-// disjoint. Aka a write to one va in the src is not reflected in the dst
-// virtual address space and vice versa.
+// Maps len bytes into vs, below the stack and above the heap. With ip,
+// the mapping shows the file from offset off, which must be page
+// aligned; pages past the end of the file read as zeros. Otherwise it
+// is zero-filled. Pages are filled when first touched, except those of
+// a shared anonymous mapping, which must exist for a fork to share
+// them. Returns the address of the mapping, or -1.
 int
-vspacecopy(struct vspace *dst, struct vspace *src)
+vspacemmap(struct vspace *vs, uint64_t len, int prot, int flags,
+           struct inode *ip, uint off)
 {
   struct vregion *vr;
+  uint64_t va;
+  uint filesz;
 
-  memmove(dst->regions, src->regions, sizeof(struct vregion) * NREGIONS);
-
-  for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++)
-    if (copy_vpi_page(&vr->pages, vr->pages) < 0)
-      return -1;
+  len = PGROUNDUP(len);
+  if (len == 0 || off % PGSIZE || !(vr = vmapinsert(vs, len)))
+    return -1;
 
-  vspaceinvalidate(dst);
+  vr->shared = (flags & MAP_SHARED) ? 1 : 0;
+  vr->readonly = (prot & PROT_WRITE) ? 0 : 1;
+  if (ip) {
+    vr->ip = idup(ip);
+    vr->off = off;
+    filesz = ip->size > off ? min((uint64_t)ip->size - off, len) : 0;
+    if (vrfiledata(vr, vr->va_base, off, filesz,
+                   vr->readonly ? 0 : VPI_WRITABLE) < 0)
+      goto bad;
+  } else if (vr->shared) {
+    if (vregionaddmap(vr, vr->va_base, len, VPI_PRESENT,
+                      vr->readonly ? 0 : VPI_WRITABLE) < 0)
+      goto bad;
+    for (va = vr->va_base; va < VRTOP(vr); va += PGSIZE)
+      vspaceupdate(vs, va);
+  }
+  return vr->va_base;
 
-  return 0;
+bad:
+  vspacemunmap(vs, vr->va_base, len);
+  return -1;
 }
 
+// Maps the n pages into vs as one shared, writable mapping, adding a
+// reference to each. Returns the address of the mapping, or -1.
 int
-vspaceshallowcopy(struct vspace *dst, struct vspace *src)
+vspacemapshared(struct vspace *vs, char **pages, int n)
 {
+  struct core_map_entry *cme;
   struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t va;
+  int i;
 
-  memmove(dst->regions, src->regions, sizeof(struct vregion) * NREGIONS);
+  if (n <= 0 || !(vr = vmapinsert(vs, (uint64_t)n * PGSIZE)))
+    return -1;
+  vr->shared = 1;
 
-  for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++)
-    if (shallow_copy_vpi_page(&vr->pages, vr->pages) < 0)
+  for (i = 0, va = vr->va_base; i < n; i++, va += PGSIZE) {
+    if (!(vpi = va2vpage_info_alloc(vr, va))) {
+      vspacemunmap(vs, vr->va_base, vr->size);
       return -1;
+    }
+    cme = pa2page(V2P(pages[i]));
+    acquire(&cme->lock);
+    cme->ref_count++;
+    release(&cme->lock);
 
-  vspaceinvalidate(dst);
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->writable = VPI_WRITABLE;
+    vpi->ppn = PGNUM(V2P(pages[i]));
+    vspaceupdate(vs, va);
+  }
+  return vr->va_base;
+}
+
+// Writes the page at va of a shared file mapping back to the file, up
+// to the file's end, if it is dirty and in [arg[0], arg[1]).
+static void
+msync1(struct vspace *vs, struct vregion *vr, uint64_t va,
+       struct vpage_info *vpi, void *arg)
+{
+  uint64_t *range = arg;
+  pte_t *pte;
+  uint off;
+
+  if (va < range[0] || va >= range[1] || !vpi->used || !vpi->present)
+    return;
+  if (!(pte = walkpml4(vs->pgtbl, (char *)va, 0)) || !(*pte & PTE_D))
+    return;
+
+  // Clean before writing, so that a store during the write dirties the
+  // page again.
+  *pte &= ~PTE_D;
+  if (myproc() && vs == myproc()->vspace)
+    invlpg((void *)va);
+
+  off = vr->off + (va - vr->va_base);
+  if (off < vr->ip->size)
+    writei(vr->ip, P2V(vpi->ppn << PT_SHIFT), off,
+           min(vr->ip->size - off, (uint)PGSIZE));
+}
+
+// Writes the pages of the shared file mappings of vs in [va, va + len)
+// that changed since they were last written back to their files.
+void
+vspacemsync(struct vspace *vs, uint64_t va, uint64_t len)
+{
+  struct vregion *vr;
+  uint64_t range[2] = { va, va + len };
+
+  for (vr = vs->maps; vr; vr = vr->next) {
+    if (!vr->shared || !vr->ip || VRTOP(vr) <= va || VRBOT(vr) >= va + len)
+      continue;
+    acquiresleep(&vr->ip->lock);
+    vpiwalk(vs, vr, vr->pages, vr->height, 0, msync1, range);
+    releasesleep(&vr->ip->lock);
+  }
+}
+
+// Removes [va, va + len) from the mappings of vs, writing shared file
+// pages back first. The range must start on a page in a mapping and
+// reach its end: a whole mapping goes away, a tail shrinks it. Returns
+// 0 on success, -1 otherwise.
+int
+vspacemunmap(struct vspace *vs, uint64_t va, uint64_t len)
+{
+  struct vregion *vr, **pp;
+
+  len = PGROUNDUP(len);
+  if (va % PGSIZE || len == 0)
+    return -1;
+  for (pp = &vs->maps; *pp; pp = &(*pp)->next)
+    if (va >= VRBOT(*pp) && va < VRTOP(*pp))
+      break;
+  if (!(vr = *pp) || va + len < VRTOP(vr))
+    return -1;
+
+  vspacemsync(vs, va, len);
+  vpiwalk(vs, vr, vr->pages, vr->height, 0, unmap1, &va);
+  if (myproc() && vs == myproc()->vspace)
+    lcr3(V2P(vs->pgtbl));
 
+  if (va > VRBOT(vr)) {
+    vr->size = va - VRBOT(vr);
+    return 0;
+  }
+  *pp = vr->next;
+  vrfree(vr);
+  vmapfree(vr);
   return 0;
 }
 
@@ -625,7 +1354,7 @@ vspacewritetova(struct vspace *vs, uint64_t va, char *data, int sz)
       return -1;
 
     vpi = va2vpage_info(vr, va);
-    assert(vpi->used);
+    assert(vpi && vpi->used);
 
     if (!vpi->writable)
       return -1;
@@ -655,3 +1384,35 @@ vawasaccessed(struct vspace *vs, uint64_t va)
 
   return accessed;
 }
+
+static void
+sample1(struct vspace *vs, struct vregion *vr, uint64_t va,
+        struct vpage_info *vpi, void *arg)
+{
+  // A huge page has one accessed bit for all its pages.
+  if (vpi->huge) {
+    if (va % PD_SIZE == 0 && vawasaccessed(vs, va))
+      (*(int *)arg) += PTRS_PER_PT;
+    return;
+  }
+  if (vpi->present && vawasaccessed(vs, va))
+    (*(int *)arg)++;
+}
+
+// Estimates the working set of vs as the number of resident pages
+// referenced since the last sample, and clears their accessed bits.
+// The swapper's clock clears accessed bits as well, so under memory
+// pressure this is an underestimate.
+void
+vspacesample(struct vspace *vs)
+{
+  int wss = 0;
+
+  vspacewalk(vs, sample1, &wss);
+  vs->stat.wss = wss;
+  vs->stat.wsstamp = ticks;
+
+  // Cached translations would keep the cleared bits from being set.
+  if (myproc() && vs == myproc()->vspace)
+    lcr3(V2P(vs->pgtbl));
+}
@@ -1,4 +1,5 @@
 #include <param.h>
+#include <cpuid.h>
 #include <cdefs.h>
 #include <defs.h>
 #include <x86_64.h>
@@ -14,6 +15,10 @@
 extern char data[];  // defined by kernel.ld
 pml4e_t *kpml4;  // for use in scheduler()
 
+// PML4 entries from here up map the kernel (the upper half of the
+// address space) and are shared by every page table.
+#define KPML4_FIRST (PTRS_PER_PML4 / 2)
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void
@@ -52,16 +57,15 @@ seginit(void)
 };
 
 
-// Return the address of the PTE in page table pgdir
+// Return the address of the PDE in page table pml4
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page table pages.
-pte_t *
-walkpml4(pml4e_t *pml4, const void *va, int alloc)
+// create any required page directory pages.
+pde_t *
+walkpgdir(pml4e_t *pml4, const void *va, int alloc)
 {
   pml4e_t *pml4e;
   pdpte_t *pdpt, *pdpte;
-  pde_t *pgdir, *pde;
-  pte_t *pgtab;
+  pde_t *pgdir;
 
   pml4e = &pml4[PML4_INDEX(va)];
 
@@ -85,7 +89,27 @@ walkpml4(pml4e_t *pml4, const void *va, int alloc)
     *pdpte = V2P(pgdir) | PTE_P | PTE_W | PTE_U;
   }
 
-  pde = &pgdir[PD_INDEX(va)];
+  return &pgdir[PD_INDEX(va)];
+}
+
+// Return the address of the PTE in page table pgdir
+// that corresponds to virtual address va.  If alloc!=0,
+// create any required page table pages. For a va in a
+// huge page, the PDE mapping it is returned instead.
+pte_t *
+walkpml4(pml4e_t *pml4, const void *va, int alloc)
+{
+  pde_t *pde;
+  pte_t *pgtab;
+
+  if ((pde = walkpgdir(pml4, va, alloc)) == 0)
+    return 0;
+
+  if (*pde & PTE_PS) {
+    if (alloc)
+      panic("walkpml4: huge page");
+    return (pte_t*)pde;
+  }
 
   if (*pde & PTE_P) {
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
@@ -129,15 +153,72 @@ mappages(pml4e_t *pml4, uint64_t virt_pn, int num_page, uint64_t phy_pn, int per
 }
 
 
-// Set up kernel part of a page table.
-pml4e_t*
-setupkvm(void)
+// Return the address of the entry for va in the level of pml4 whose
+// entries map size bytes (PDPT_SIZE or PD_SIZE), creating the levels
+// above it.
+static uint64_t *
+walklarge(pml4e_t *pml4, uint64_t va, uint64_t size)
+{
+  uint64_t *table = pml4, *e;
+  int shift;
+
+  for (shift = PML4_SHIFT; (UINT64_C(1) << shift) > size; shift -= 9) {
+    e = &table[(va >> shift) & (PTRS_PER_PML4 - 1)];
+    if (*e & PTE_P) {
+      if (*e & PTE_PS)
+        panic("remap");
+      table = P2V(PTE_ADDR(*e));
+    } else {
+      if ((table = (uint64_t*)kalloc()) == 0)
+        return 0;
+      memset(table, 0, PGSIZE);
+      *e = V2P(table) | PTE_P | PTE_W;
+    }
+  }
+  return &table[(va >> shift) & (PTRS_PER_PML4 - 1)];
+}
+
+// Map [pa, end) at va in the kernel page table with the largest pages
+// that fit: 1 GiB where the cpu supports them, then 2 MiB, then 4 KiB
+// for the unaligned edges.
+static void
+kmapregion(pml4e_t *pml4, uint64_t va, uint64_t pa, uint64_t end, int perm, int gbpages)
+{
+  uint64_t size, *e;
+
+  while (pa < end) {
+    if (gbpages && (va | pa) % PDPT_SIZE == 0 && end - pa >= PDPT_SIZE)
+      size = PDPT_SIZE;
+    else if ((va | pa) % PD_SIZE == 0 && end - pa >= PD_SIZE)
+      size = PD_SIZE;
+    else
+      size = PGSIZE;
+
+    if (size == PGSIZE) {
+      mappages(pml4, va >> PT_SHIFT, 1, pa >> PT_SHIFT, perm | PTE_P, 1);
+    } else {
+      if ((e = walklarge(pml4, va, size)) == 0)
+        panic("not enough memory");
+      if (*e & PTE_P)
+        panic("remap");
+      *e = PTE(pa, perm | PTE_P | PTE_PS);
+    }
+    va += size;
+    pa += size;
+  }
+}
+
+// Build the kernel page table, kpml4. Every other page table shares
+// its kernel half, so it is built once at boot and never changes after.
+void
+kvmalloc(void)
 {
   pml4e_t *pml4;
   struct kmap *k;
+  int gbpages = cpu_has_feature(CPUID_FEATURE_PDPE1GB);
 
   if((pml4 = (pml4e_t*)kalloc()) == 0)
-    return 0;
+    panic("kvmalloc");
   memset(pml4, 0, PGSIZE);
 
   struct kmap {
@@ -152,10 +233,23 @@ setupkvm(void)
     { (void*)DEVSPACE, 0xFE000000,    0x100000000,         PTE_W}, // more devices
   };
 
-  for(k = kmap; k < &kmap[NELEM(kmap)]; k++) {
-    if(mappages(pml4, (uint64_t)(k->virt) >> PT_SHIFT, (k->phys_end - k->phys_start) >> PT_SHIFT, k->phys_start >> PT_SHIFT, k->perm | PTE_P, 1) < 0)
-      return 0;
-  }
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    kmapregion(pml4, (uint64_t)k->virt, k->phys_start, k->phys_end, k->perm, gbpages);
+  kpml4 = pml4;
+}
+
+// Set up kernel part of a page table. The kernel entries point at
+// kpml4's PDPTs, so only the PML4 page itself is new.
+pml4e_t*
+setupkvm(void)
+{
+  pml4e_t *pml4;
+
+  if((pml4 = (pml4e_t*)kalloc()) == 0)
+    return 0;
+  memset(pml4, 0, PGSIZE);
+  memmove(&pml4[KPML4_FIRST], &kpml4[KPML4_FIRST],
+          (PTRS_PER_PML4 - KPML4_FIRST) * sizeof(pml4e_t));
   return pml4;
 }
 
@@ -221,46 +315,57 @@ deallocuvm(pml4e_t *pml4, char* start, uint64_t oldsz, uint64_t newsz)
   return newsz;
 }
 
-void
-freevm_pgdir(pde_t *pgdir)
+// Free a page table page and the user pages it maps.
+static void
+freevm_pgtab(pte_t *pgtab)
 {
   uint i;
+  for (i = 0; i < PTRS_PER_PT; i++) {
+    if (pgtab[i] & PTE_P)
+      kfree(P2V(PTE_ADDR(pgtab[i])));
+  }
+  kfree((char*) pgtab);
+}
+
+static void
+freevm_pgdir(pde_t *pgdir)
+{
+  uint i, j;
   for (i = 0; i < PTRS_PER_PD; i++) {
-    if (pgdir[i] & PTE_P) {
-      char *v = P2V(PTE_ADDR(pgdir[i]));
-      kfree(v);
-    }
+    if ((pgdir[i] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+      // A huge page is made of pages that are freed one by one.
+      for (j = 0; j < PTRS_PER_PT; j++)
+        kfree(P2V(PTE_ADDR(pgdir[i]) + j * PGSIZE));
+    } else if (pgdir[i] & PTE_P)
+      freevm_pgtab(P2V(PTE_ADDR(pgdir[i])));
   }
   kfree((char*) pgdir);
 }
 
-void
+static void
 freevm_pdpt(pdpte_t *pdpt)
 {
   uint i;
   for (i = 0; i < PTRS_PER_PDPT; i++) {
-    if (pdpt[i] & PTE_P) {
-      pde_t *pgdir = P2V(PDE_ADDR(pdpt[i]));
-      freevm_pgdir(pgdir);
-    }
+    if (pdpt[i] & PTE_P)
+      freevm_pgdir(P2V(PDE_ADDR(pdpt[i])));
   }
   kfree((char*) pdpt);
 }
 
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part. Only the levels that are present are
+// visited; the kernel half belongs to kpml4 and is left alone.
 void
 freevm(pml4e_t *pml4)
 {
   uint i;
   assertm(pml4, "freevm: no pml4");
-  deallocuvm(pml4, 0, SZ_4G, 0);
-  for(i = 0; i < PTRS_PER_PML4; i++){
-    if(pml4[i] & PTE_P){
-      pdpte_t *pdpt = P2V(PDPT_ADDR(pml4[i]));
-      freevm_pdpt(pdpt);
-    }
+  assertm(pml4 != kpml4, "freevm: kpml4");
+  for(i = 0; i < KPML4_FIRST; i++){
+    if(pml4[i] & PTE_P)
+      freevm_pdpt(P2V(PDPT_ADDR(pml4[i])));
   }
   kfree((char*)pml4);
 }
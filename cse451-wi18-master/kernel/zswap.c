@@ -0,0 +1,379 @@
+// Compressed swap cache.
+//
+// Pages on their way to swap are first compressed into a pool of
+// ZSWAPPAGES pages kept in memory. A fault on such a page decompresses
+// it without touching the disk. When the pool is full, the oldest
+// compressed pages are written back to their swap slots to make room.
+//
+// Entries are keyed by swap slot, so a page is always backed by a slot
+// and the rest of the swap code does not care which tier holds it.
+// The pool is carved into ZCHUNK-byte chunks; a compressed page takes
+// a run of chunks within one pool page.
+//
+// The codec is a small LZ77 variant in the style of LZ4: a sequence is
+// a token byte (literal count in the high nibble, match length - 4 in
+// the low nibble, 15 meaning more length bytes follow), the literals,
+// then a 2-byte little-endian match offset. The last sequence has
+// literals only.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <mmu.h>
+#include <param.h>
+#include <spinlock.h>
+#include <sysinfo.h>
+
+#define ZCHUNK 64
+#define ZCHUNKS (PGSIZE / ZCHUNK) // chunks per pool page
+#define ZMAXLEN (PGSIZE * 3 / 4)  // store only pages that compress this well
+#define ZNENTRY (ZSWAPPAGES * 16)
+#define ZNHASH 64
+#define ZNONE 0xffff
+
+#define LZMINMATCH 4
+#define LZHASHBITS 10
+
+struct zentry {
+  uint64_t spn;
+  uint seq;     // store order; the smallest is written back first
+  ushort len;   // compressed length, 0 if the entry is free
+  uchar page;   // pool page
+  uchar chunk;  // first chunk
+  ushort next;  // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  char *pool[ZSWAPPAGES];
+  uint64_t chunkmap[ZSWAPPAGES]; // bit set if the chunk is in use
+  struct zentry entries[ZNENTRY];
+  ushort hash[ZNHASH];
+  uint seq;
+  ushort lzhash[1 << LZHASHBITS]; // compressor match finder
+  uchar buf[ZMAXLEN];             // compressor output
+  char wb[PGSIZE];                // page being written back
+
+  // Statistics.
+  int pages;      // pages held compressed
+  int bytes;      // compressed bytes held
+  int hits;       // swap reads served from the pool
+  int misses;     // swap reads that went to disk
+  int writebacks; // pages written back to make room
+  int rejects;    // pages that did not compress well enough
+} zswap;
+
+static inline uint
+read32(const uchar *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24;
+}
+
+// Appends one sequence: lit literals from src, then a match of len
+// bytes at offset off unless len is 0. Returns the new output length,
+// or -1 if it would exceed max.
+static int
+lzemit(uchar *dst, int op, int max, const uchar *src, int lit, int off, int len)
+{
+  int n;
+
+  if (op + 1 + lit / 255 + 1 + lit + 2 + len / 255 + 1 > max)
+    return -1;
+
+  dst[op++] = min(lit, 15) << 4 | (len ? min(len - LZMINMATCH, 15) : 0);
+  if (lit >= 15) {
+    for (n = lit - 15; n >= 255; n -= 255)
+      dst[op++] = 255;
+    dst[op++] = n;
+  }
+  memmove(dst + op, src, lit);
+  op += lit;
+  if (len == 0)
+    return op;
+
+  dst[op++] = off & 0xff;
+  dst[op++] = off >> 8;
+  if (len - LZMINMATCH >= 15) {
+    for (n = len - LZMINMATCH - 15; n >= 255; n -= 255)
+      dst[op++] = 255;
+    dst[op++] = n;
+  }
+  return op;
+}
+
+// Compresses the page src into dst. Returns the compressed length, or
+// -1 if it would exceed max. Caller must hold zswap.lock.
+static int
+lzcompress(const uchar *src, uchar *dst, int max)
+{
+  int ip, anchor, op, ref, len;
+  uint h;
+
+  memset(zswap.lzhash, 0, sizeof(zswap.lzhash));
+  ip = anchor = op = 0;
+  while (ip + LZMINMATCH <= PGSIZE) {
+    h = (read32(src + ip) * 2654435761U) >> (32 - LZHASHBITS);
+    ref = zswap.lzhash[h] - 1;
+    zswap.lzhash[h] = ip + 1;
+    if (ref < 0 || read32(src + ref) != read32(src + ip)) {
+      ip++;
+      continue;
+    }
+
+    for (len = LZMINMATCH; ip + len < PGSIZE && src[ref + len] == src[ip + len]; len++)
+      ;
+    if ((op = lzemit(dst, op, max, src + anchor, ip - anchor, ip - ref, len)) < 0)
+      return -1;
+    ip += len;
+    anchor = ip;
+  }
+  return lzemit(dst, op, max, src + anchor, PGSIZE - anchor, 0, 0);
+}
+
+// Decompresses n bytes from src into the page dst. Returns 0 if that
+// yields exactly one page, -1 otherwise.
+static int
+lzdecompress(const uchar *src, int n, uchar *dst)
+{
+  int ip, op, lit, len, off, b;
+
+  ip = op = 0;
+  while (ip < n) {
+    b = src[ip++];
+    len = b & 15;
+    lit = b >> 4;
+    if (lit == 15)
+      do {
+        if (ip >= n)
+          return -1;
+        lit += (b = src[ip++]);
+      } while (b == 255);
+    if (ip + lit > n || op + lit > PGSIZE)
+      return -1;
+    memmove(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == n)
+      break;
+
+    if (ip + 2 > n)
+      return -1;
+    off = src[ip] | src[ip + 1] << 8;
+    ip += 2;
+    if (len == 15)
+      do {
+        if (ip >= n)
+          return -1;
+        len += (b = src[ip++]);
+      } while (b == 255);
+    len += LZMINMATCH;
+    if (off == 0 || off > op || op + len > PGSIZE)
+      return -1;
+    // Byte at a time: the match may overlap what it produces.
+    for (; len > 0; len--, op++)
+      dst[op] = dst[op - off];
+  }
+  return op == PGSIZE ? 0 : -1;
+}
+
+void
+zswapinit(void)
+{
+  int i;
+
+  initlock(&zswap.lock, "zswap");
+  for (i = 0; i < ZNHASH; i++)
+    zswap.hash[i] = ZNONE;
+  for (i = 0; i < ZSWAPPAGES; i++)
+    if (!(zswap.pool[i] = kalloc()))
+      break;
+}
+
+// Returns the entry for slot spn, or 0. Caller must hold zswap.lock.
+static struct zentry *
+lookup(uint64_t spn)
+{
+  ushort e;
+
+  for (e = zswap.hash[spn % ZNHASH]; e != ZNONE; e = zswap.entries[e].next)
+    if (zswap.entries[e].spn == spn)
+      return &zswap.entries[e];
+  return 0;
+}
+
+static inline char *
+entrydata(struct zentry *ze)
+{
+  return zswap.pool[ze->page] + ze->chunk * ZCHUNK;
+}
+
+// Frees ze and its chunks. Caller must hold zswap.lock.
+static void
+drop(struct zentry *ze)
+{
+  ushort *pp;
+  int n = (ze->len + ZCHUNK - 1) / ZCHUNK;
+
+  for (pp = &zswap.hash[ze->spn % ZNHASH]; *pp != ze - zswap.entries;
+       pp = &zswap.entries[*pp].next)
+    ;
+  *pp = ze->next;
+
+  zswap.chunkmap[ze->page] &= ~(((n == 64 ? 0 : 1ULL << n) - 1) << ze->chunk);
+  zswap.pages--;
+  zswap.bytes -= ze->len;
+  ze->len = 0;
+}
+
+// Finds room for len bytes and a free entry. Returns the entry with its
+// chunks marked in use, or 0. Caller must hold zswap.lock.
+static struct zentry *
+reserve(int len)
+{
+  struct zentry *ze;
+  uint64_t mask;
+  int n = (len + ZCHUNK - 1) / ZCHUNK;
+  int p, c;
+
+  for (ze = zswap.entries; ze < &zswap.entries[ZNENTRY]; ze++)
+    if (ze->len == 0)
+      break;
+  if (ze == &zswap.entries[ZNENTRY])
+    return 0;
+
+  mask = (n == 64 ? 0 : 1ULL << n) - 1;
+  for (p = 0; p < ZSWAPPAGES && zswap.pool[p]; p++) {
+    for (c = 0; c + n <= ZCHUNKS; c++) {
+      if (!(zswap.chunkmap[p] & (mask << c))) {
+        zswap.chunkmap[p] |= mask << c;
+        ze->page = p;
+        ze->chunk = c;
+        return ze;
+      }
+    }
+  }
+  return 0;
+}
+
+// Writes the oldest compressed page back to its swap slot. Returns 0
+// on success, -1 if the pool is empty. Caller must hold zswap.lock,
+// which is dropped around the disk write.
+static int
+writeback(void)
+{
+  struct zentry *ze, *old = 0;
+  char *wb = zswap.wb;
+  uint64_t spn;
+
+  for (ze = zswap.entries; ze < &zswap.entries[ZNENTRY]; ze++)
+    if (ze->len && (!old || (int)(ze->seq - old->seq) < 0))
+      old = ze;
+  if (!old)
+    return -1;
+
+  if (lzdecompress((uchar *)entrydata(old), old->len, (uchar *)wb) < 0)
+    panic("zswap: corrupt entry");
+  spn = old->spn;
+  drop(old);
+  zswap.writebacks++;
+
+  release(&zswap.lock);
+  swapio(spn, &wb, 1, 1);
+  acquire(&zswap.lock);
+  return 0;
+}
+
+// Stores a compressed copy of the page src for slot spn, writing back
+// older pages if the pool is full. Returns 0 if stored, -1 if the page
+// must go to disk. Caller must hold the swapper lock, which serializes
+// writebacks.
+int
+zswapstore(uint64_t spn, char *src)
+{
+  struct zentry *ze;
+  int len;
+
+  acquire(&zswap.lock);
+  if (!zswap.pool[0] ||
+      (len = lzcompress((uchar *)src, zswap.buf, sizeof(zswap.buf))) < 0) {
+    zswap.rejects++;
+    release(&zswap.lock);
+    return -1;
+  }
+
+  while (!(ze = reserve(len))) {
+    // writeback drops the lock, but only swap-outs store and they are
+    // serialized, so the compressed data in buf stays put.
+    if (writeback() < 0) {
+      release(&zswap.lock);
+      return -1;
+    }
+  }
+
+  memmove(entrydata(ze), zswap.buf, len);
+  ze->spn = spn;
+  ze->len = len;
+  ze->seq = zswap.seq++;
+  ze->next = zswap.hash[spn % ZNHASH];
+  zswap.hash[spn % ZNHASH] = ze - zswap.entries;
+  zswap.pages++;
+  zswap.bytes += len;
+  release(&zswap.lock);
+  return 0;
+}
+
+// Decompresses the page for slot spn into dst. The entry stays until
+// the slot is freed. Returns 0 on a hit, -1 if the page is on disk.
+int
+zswapload(uint64_t spn, char *dst)
+{
+  struct zentry *ze;
+
+  acquire(&zswap.lock);
+  if (!(ze = lookup(spn))) {
+    zswap.misses++;
+    release(&zswap.lock);
+    return -1;
+  }
+  if (lzdecompress((uchar *)entrydata(ze), ze->len, (uchar *)dst) < 0)
+    panic("zswap: corrupt entry");
+  zswap.hits++;
+  release(&zswap.lock);
+  return 0;
+}
+
+// Tests whether slot spn is held compressed rather than on disk.
+int
+zswapcontains(uint64_t spn)
+{
+  int r;
+
+  acquire(&zswap.lock);
+  r = lookup(spn) != 0;
+  release(&zswap.lock);
+  return r;
+}
+
+// Forgets the compressed page for slot spn, which has been freed.
+void
+zswapinvalidate(uint64_t spn)
+{
+  struct zentry *ze;
+
+  acquire(&zswap.lock);
+  if ((ze = lookup(spn)))
+    drop(ze);
+  release(&zswap.lock);
+}
+
+void
+zswapstat(struct sys_info *info)
+{
+  acquire(&zswap.lock);
+  info->zswap_pages = zswap.pages;
+  info->zswap_bytes = zswap.bytes;
+  info->zswap_hits = zswap.hits;
+  info->zswap_misses = zswap.misses;
+  info->zswap_writebacks = zswap.writebacks;
+  info->zswap_rejects = zswap.rejects;
+  release(&zswap.lock);
+}
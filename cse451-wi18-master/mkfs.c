@@ -28,7 +28,7 @@ typedef unsigned char  uchar;
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
-int swapsize = 2048 * 8;
+int swapsize = NSWAPSLOTS * 8; // 8 blocks per page
 int logsize = 40;
 
 int fsfd;
@@ -107,6 +107,7 @@ main(int argc, char *argv[])
   sb.size = xint(FSSIZE);
   sb.nblocks = xint(nblocks);
   sb.swapstart = xint(2);
+  sb.nswap = xint(swapsize);
   sb.logstart = xint(2 + swapsize);
   sb.bmapstart = xint(2 + swapsize + logsize);
   sb.inodestart = xint(2 + nbitmap + swapsize + logsize);
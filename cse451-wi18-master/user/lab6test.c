@@ -0,0 +1,217 @@
+#include <cdefs.h>
+#include <fcntl.h>
+#include <mman.h>
+#include <spawn.h>
+#include <stat.h>
+#include <user.h>
+
+int stdout = 1;
+
+#define error(msg, ...)                                                        \
+  do {                                                                         \
+    printf(stdout, "ERROR (line %d): ", __LINE__);                             \
+    printf(stdout, msg, ##__VA_ARGS__);                                        \
+    printf(stdout, "\n");                                                      \
+    while (1) {                                                                \
+    }                                                                          \
+  } while (0)
+
+#define PGSIZE 4096
+#define NINCR 20000
+
+struct mutex lock;
+struct cond cv;
+volatile int counter;
+volatile int ready;
+volatile int reply;
+
+void incr(void *arg) {
+  int i;
+
+  for (i = 0; i < NINCR; i++) {
+    mutex_lock(&lock);
+    counter++;
+    mutex_unlock(&lock);
+  }
+}
+
+void mutextest(void) {
+  int t1, t2;
+
+  mutex_init(&lock);
+  counter = 0;
+  if ((t1 = thread_create(incr, 0)) < 0 || (t2 = thread_create(incr, 0)) < 0)
+    error("thread_create failed");
+  if (thread_join(t1) != t1 || thread_join(t2) != t2)
+    error("thread_join failed");
+  if (counter != 2 * NINCR)
+    error("counter is %d, should be %d", counter, 2 * NINCR);
+  printf(stdout, "mutextest OK\n");
+}
+
+void waiter(void *arg) {
+  mutex_lock(&lock);
+  while (!ready)
+    cond_wait(&cv, &lock);
+  reply = 1;
+  cond_signal(&cv);
+  mutex_unlock(&lock);
+}
+
+void condtest(void) {
+  int t;
+
+  mutex_init(&lock);
+  cond_init(&cv);
+  ready = reply = 0;
+  if ((t = thread_create(waiter, 0)) < 0)
+    error("thread_create failed");
+
+  // Give the waiter time to block first.
+  sleep(10);
+  mutex_lock(&lock);
+  ready = 1;
+  cond_signal(&cv);
+  while (!reply)
+    cond_wait(&cv, &lock);
+  mutex_unlock(&lock);
+
+  if (thread_join(t) != t)
+    error("thread_join failed");
+  printf(stdout, "condtest OK\n");
+}
+
+void sharedmaptest(void) {
+  char buf[PGSIZE];
+  char *a, *b;
+  int fd, fd2, i;
+
+  if ((fd = open("lab6file", O_CREATE | O_RDWR)) < 0)
+    error("could not create lab6file");
+  memset(buf, 'a', PGSIZE);
+  if (write(fd, buf, PGSIZE) != PGSIZE)
+    error("could not write lab6file");
+
+  a = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (a == MAP_FAILED)
+    error("mmap failed");
+  if (a[0] != 'a' || a[PGSIZE - 1] != 'a')
+    error("mapping does not hold the file");
+
+  // A child's stores through the mapping are seen by the parent.
+  if (fork() == 0) {
+    strcpy(a, "child");
+    exit();
+  }
+  wait();
+  if (strcmp(a, "child") != 0)
+    error("store by the child not seen through the mapping");
+
+  // write() to the file is seen through the mapping.
+  if ((fd2 = open("lab6file", O_RDWR)) < 0)
+    error("could not reopen lab6file");
+  if (write(fd2, "write", 6) != 6)
+    error("could not write lab6file");
+  close(fd2);
+  if (strcmp(a, "write") != 0)
+    error("write() not seen through the mapping");
+
+  // A later mapping of the file shares the page with the first.
+  b = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (b == MAP_FAILED)
+    error("second mmap failed");
+  b[100] = 'b';
+  if (a[100] != 'b' || strcmp(b, "write") != 0)
+    error("mappings of the same file do not share the page");
+  for (i = 6; i < PGSIZE; i++)
+    if (i != 100 && a[i] != 'a')
+      error("byte %d of the mapping is %d", i, a[i]);
+
+  if (munmap(b, PGSIZE) < 0 || munmap(a, PGSIZE) < 0)
+    error("munmap failed");
+  close(fd);
+  printf(stdout, "sharedmaptest OK\n");
+}
+
+void munmaptest(void) {
+  char *a, c;
+  int fds[2], i;
+
+  a = mmap(0, 4 * PGSIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (a == MAP_FAILED)
+    error("mmap failed");
+  for (i = 0; i < 4; i++)
+    a[i * PGSIZE] = 'w' + i;
+
+  // Unmap the middle of the region; its ends stay.
+  if (munmap(a + PGSIZE, 2 * PGSIZE) < 0)
+    error("munmap of part of a region failed");
+  if (a[0] != 'w' || a[3 * PGSIZE] != 'z')
+    error("pages left mapped lost their data");
+
+  // Touching the hole kills the process.
+  if (pipe(fds) < 0)
+    error("pipe failed");
+  if (fork() == 0) {
+    close(fds[0]);
+    c = a[PGSIZE];
+    write(fds[1], &c, 1);
+    exit();
+  }
+  close(fds[1]);
+  if (read(fds[0], &c, 1) != 0)
+    error("unmapped page could still be read");
+  close(fds[0]);
+  wait();
+
+  if (munmap(a, PGSIZE) < 0 || munmap(a + 3 * PGSIZE, PGSIZE) < 0)
+    error("munmap of the rest failed");
+  printf(stdout, "munmaptest OK\n");
+}
+
+void spawntest(void) {
+  char *argv[] = { "cat", "small.txt", 0 };
+  struct spawn_action fa[3];
+  char buf[64], want[64];
+  int fds[2], fd, i, m, n, pid;
+
+  if (pipe(fds) < 0)
+    error("pipe failed");
+  fa[0].op = SPAWN_DUP2;
+  fa[0].fd = fds[1];
+  fa[0].newfd = 1;
+  fa[1].op = SPAWN_CLOSE;
+  fa[1].fd = fds[0];
+  fa[2].op = SPAWN_CLOSE;
+  fa[2].fd = fds[1];
+  if ((pid = spawn("cat", argv, fa, 3)) < 0)
+    error("spawn failed");
+  close(fds[1]);
+
+  if ((fd = open("small.txt", O_RDONLY)) < 0)
+    error("could not open small.txt");
+  if ((n = read(fd, want, sizeof(want))) <= 0)
+    error("could not read small.txt");
+  close(fd);
+  for (i = 0; i < n; i += m)
+    if ((m = read(fds[0], buf + i, n - i)) <= 0)
+      error("spawned cat did not write small.txt to the pipe");
+  for (i = 0; i < n; i++)
+    if (buf[i] != want[i])
+      error("spawned cat wrote %d at %d, should be %d", buf[i], i, want[i]);
+  close(fds[0]);
+  if (wait() != pid)
+    error("wait did not return the spawned process");
+  printf(stdout, "spawntest OK\n");
+}
+
+int main(int argc, char *argv[]) {
+  mutextest();
+  condtest();
+  sharedmaptest();
+  munmaptest();
+  spawntest();
+  printf(stdout, "lab6 tests passed!!\n");
+  exit();
+}
@@ -2,6 +2,7 @@
 
 #include <cdefs.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <user.h>
 
 // Parsed command representation
@@ -53,6 +54,22 @@ int fork1(void); // Fork but panics on failure.
 void panic(char *);
 struct cmd *parsecmd(char *);
 
+// Starts cmd, if it is a plain command, as one end of the pipe p: fd,
+// 0 or 1, is rebound to p[fd]. spawn starts it without copying the
+// shell as fork would. Returns -1 if the caller must fork for it.
+int spawnpipe(struct cmd *cmd, int *p, int fd) {
+  struct execcmd *ecmd = (struct execcmd *)cmd;
+  struct spawn_action fa[] = {
+      {SPAWN_DUP2, p[fd], fd},
+      {SPAWN_CLOSE, p[0], 0},
+      {SPAWN_CLOSE, p[1], 0},
+  };
+
+  if (cmd->type != EXEC || ecmd->argv[0] == 0)
+    return -1;
+  return spawn(ecmd->argv[0], ecmd->argv, fa, 3);
+}
+
 // Execute cmd.  Never returns.
 void runcmd(struct cmd *cmd) {
   int p[2];
@@ -99,14 +116,14 @@ void runcmd(struct cmd *cmd) {
     pcmd = (struct pipecmd *)cmd;
     if (pipe(p) < 0)
       panic("pipe");
-    if (fork1() == 0) {
+    if (spawnpipe(pcmd->left, p, 1) < 0 && fork1() == 0) {
       close(1);
       dup(p[1]);
       close(p[0]);
       close(p[1]);
       runcmd(pcmd->left);
     }
-    if (fork1() == 0) {
+    if (spawnpipe(pcmd->right, p, 0) < 0 && fork1() == 0) {
       close(0);
       dup(p[0]);
       close(p[0]);
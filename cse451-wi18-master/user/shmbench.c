@@ -0,0 +1,135 @@
+// Compares moving bulk data between two processes through a pipe with
+// moving it through a shared memory segment.
+//
+// In both runs a child produces TOTAL bytes and the parent checksums
+// them. Through the pipe, every byte is copied into the kernel's ring
+// and out again. Through shared memory, the child fills one half of a
+// double buffer while the parent reads the other, and the pipes only
+// carry a one-byte token per half.
+
+#include <cdefs.h>
+#include <user.h>
+
+#define TOTAL (2 * 1024 * 1024) // bytes moved per run
+#define HALF (32 * 1024)        // half of the shared double buffer
+#define PIPECHUNK 4096          // bytes per pipe write
+
+char buf[PIPECHUNK];
+
+static void
+fill(char *p, int n, int off)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    p[i] = off + i;
+}
+
+static uint
+sum(char *p, int n)
+{
+  uint s = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    s += (uchar)p[i];
+  return s;
+}
+
+static void
+report(char *name, int ticks, uint s, uint want)
+{
+  printf(1, "%s: %d bytes in %d ticks%s\n", name, TOTAL, ticks,
+         s == want ? "" : " (bad checksum)");
+}
+
+static void
+pipebench(uint want)
+{
+  int fds[2], start, n;
+  uint s = 0;
+  int off;
+
+  if (pipe(fds) < 0) {
+    printf(2, "shmbench: pipe failed\n");
+    return;
+  }
+
+  start = uptime();
+  if (fork() == 0) {
+    close(fds[0]);
+    for (off = 0; off < TOTAL; off += PIPECHUNK) {
+      fill(buf, PIPECHUNK, off);
+      write(fds[1], buf, PIPECHUNK);
+    }
+    close(fds[1]);
+    exit();
+  }
+  close(fds[1]);
+  while ((n = read(fds[0], buf, PIPECHUNK)) > 0)
+    s += sum(buf, n);
+  close(fds[0]);
+  wait();
+  report("pipe", uptime() - start, s, want);
+}
+
+static void
+shmbench(uint want)
+{
+  int full[2], empty[2], id, start, off;
+  char *p, t = 0;
+  uint s = 0;
+
+  if ((id = shmopen("shmbench", 2 * HALF)) < 0 ||
+      (p = shmat(id)) == (char *)-1) {
+    printf(2, "shmbench: no shared memory\n");
+    return;
+  }
+  // The mapping keeps the pages, and the child inherits it.
+  shmunlink("shmbench");
+  if (pipe(full) < 0 || pipe(empty) < 0) {
+    printf(2, "shmbench: pipe failed\n");
+    return;
+  }
+
+  start = uptime();
+  if (fork() == 0) {
+    close(full[0]);
+    close(empty[1]);
+    for (off = 0; off < TOTAL; off += HALF) {
+      // Both halves start out free.
+      if (off >= 2 * HALF)
+        read(empty[0], &t, 1);
+      fill(p + off % (2 * HALF), HALF, off);
+      write(full[1], &t, 1);
+    }
+    exit();
+  }
+  close(full[1]);
+  close(empty[0]);
+  for (off = 0; off < TOTAL; off += HALF) {
+    read(full[0], &t, 1);
+    s += sum(p + off % (2 * HALF), HALF);
+    write(empty[1], &t, 1);
+  }
+  close(full[0]);
+  close(empty[1]);
+  wait();
+  report("shm", uptime() - start, s, want);
+  munmap(p, 2 * HALF);
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint want = 0;
+  int i;
+
+  for (i = 0; i < TOTAL; i++)
+    want += (uchar)i;
+
+  pipebench(want);
+  shmbench(want);
+  exit();
+  return 0;
+}
@@ -6,6 +6,23 @@
 
 int main(int argc, char *argv[]) {
   struct sys_info info;
+  struct proc_info pinfo;
+
+  // sysinfo pid: memory use and priority of one process
+  if (argc > 1) {
+    if (procinfo(atoi(argv[1]), &pinfo) < 0) {
+      printf(2, "sysinfo: no process %s\n", argv[1]);
+      exit();
+    }
+    printf(1, "rss = %d, swapped = %d, wss = %d\n", pinfo.rss, pinfo.swapped,
+           pinfo.wss);
+    printf(1, "major_faults = %d, minor_faults = %d, cow_breaks = %d\n",
+           pinfo.major_faults, pinfo.minor_faults, pinfo.cow_breaks);
+    printf(1, "huge_pages = %d, priority = %d\n", pinfo.huge_pages,
+           pinfo.priority);
+    exit();
+  }
+
   sysinfo(&info);
 
   printf(1, "pages_in_use = %d\n", info.pages_in_use);
@@ -13,6 +30,12 @@ int main(int argc, char *argv[]) {
   printf(1, "free_pages = %d\n", info.free_pages);
   printf(1, "num_page_faults = %d\n", info.num_page_faults);
   printf(1, "num_disk_reads = %d\n", info.num_disk_reads);
+  printf(1, "zswap_pages = %d (%d bytes)\n", info.zswap_pages, info.zswap_bytes);
+  printf(1, "zswap_hits = %d, zswap_misses = %d\n", info.zswap_hits, info.zswap_misses);
+  printf(1, "zswap_writebacks = %d, zswap_rejects = %d\n", info.zswap_writebacks,
+         info.zswap_rejects);
+  printf(1, "pcache_pages = %d, pcache_hits = %d, pcache_misses = %d\n",
+         info.pcache_pages, info.pcache_hits, info.pcache_misses);
 
   exit();
 }
@@ -84,4 +84,64 @@ void *memmove(void *vdst, void *vsrc, int n) {
   while (n-- > 0)
     *dst++ = *src++;
   return vdst;
-}
\ No newline at end of file
+}
+
+// First function of a thread made by thread_create.
+static void threadmain(void *fn, void *arg) {
+  ((void (*)(void *))fn)(arg);
+  exit();
+}
+
+// Starts a thread running fn(arg) in this process, which exits when fn
+// returns. Returns its id for thread_join, or -1.
+int thread_create(void (*fn)(void *), void *arg) {
+  return clone(threadmain, (void *)fn, arg);
+}
+
+// The mutex is Drepper's from "Futexes Are Tricky": taking a free one
+// or freeing one nobody waits for is a single atomic instruction, and
+// only contention enters the kernel.
+void mutex_init(struct mutex *m) { m->state = 0; }
+
+void mutex_lock(struct mutex *m) {
+  int c;
+
+  if ((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+  // Mark it contended, so that the holder wakes us.
+  if (c != 2)
+    c = __sync_lock_test_and_set(&m->state, 2);
+  while (c != 0) {
+    futex_wait(&m->state, 2, 0);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void mutex_unlock(struct mutex *m) {
+  if (__sync_fetch_and_sub(&m->state, 1) != 1) {
+    m->state = 0;
+    futex_wake(&m->state, 1);
+  }
+}
+
+void cond_init(struct cond *c) { c->seq = 0; }
+
+// A signal between unlocking m and sleeping changes seq, so the
+// futex_wait returns at once instead of missing it.
+void cond_wait(struct cond *c, struct mutex *m) {
+  int seq = c->seq;
+
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq, 0);
+  mutex_lock(m);
+}
+
+void cond_signal(struct cond *c) {
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void cond_broadcast(struct cond *c) {
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 0x7fffffff);
+}